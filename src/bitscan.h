@@ -0,0 +1,152 @@
+#ifndef _BITSCAN_H
+#define _BITSCAN_H
+
+// Word-at-a-time helpers for packed bitmaps (MSB = first pixel).
+// skip_fill_*() has SSE2/AVX2 variants; the caller picks one for the cpu.
+
+#include <stdint.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if defined(__SSE2__)||defined(_M_X64)||(defined(_M_IX86_FP)&&(_M_IX86_FP>=2))
+#include <emmintrin.h>
+#define BITSCAN_SSE2 1
+#endif
+#if defined(__GNUC__)&&(defined(__x86_64__)||defined(__i386__))&&defined(BITSCAN_SSE2)
+#include <immintrin.h>
+#define BITSCAN_AVX2 1
+#endif
+
+// big-endian loads/stores: the first pixel is the most significant bit
+static inline uint64_t load_be64(const unsigned char *p)
+{
+    return ((uint64_t)p[0]<<56)|((uint64_t)p[1]<<48)|((uint64_t)p[2]<<40)|((uint64_t)p[3]<<32)|
+           ((uint64_t)p[4]<<24)|((uint64_t)p[5]<<16)|((uint64_t)p[6]<<8)|(uint64_t)p[7];
+}
+
+static inline void store_be64(unsigned char *p,uint64_t val)
+{
+    p[0]=val>>56;
+    p[1]=val>>48;
+    p[2]=val>>40;
+    p[3]=val>>32;
+    p[4]=val>>24;
+    p[5]=val>>16;
+    p[6]=val>>8;
+    p[7]=val;
+}
+
+// like load_be64, but only >len (<8) bytes are available; the rest reads as 0
+static inline uint64_t load_be64_part(const unsigned char *p,int len)
+{
+    uint64_t ret=0;
+    int iA;
+
+    for (iA=0; iA<len; iA++)
+    {
+        ret|=(uint64_t)p[iA]<<(56-8*iA);
+    }
+    return ret;
+}
+
+// number of leading zero bits, >val!=0
+static inline int clz64(uint64_t val)
+{
+#if defined(__GNUC__)
+    return __builtin_clzll(val);
+#elif defined(_MSC_VER)&&defined(_M_X64)
+    unsigned long ret;
+    _BitScanReverse64(&ret,val);
+    return 63-ret;
+#else
+    int ret=0;
+    while (!(val&((uint64_t)1<<63)))
+    {
+        val<<=1;
+        ret++;
+    }
+    return ret;
+#endif
+}
+
+// number of trailing zero bits, >val!=0
+static inline int ctz32(uint32_t val)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(val);
+#elif defined(_MSC_VER)
+    unsigned long ret;
+    _BitScanForward(&ret,val);
+    return ret;
+#else
+    int ret=0;
+    while (!(val&1))
+    {
+        val>>=1;
+        ret++;
+    }
+    return ret;
+#endif
+}
+
+// returns the number of leading bytes of >buf[0..len) that are equal to >fill
+static inline size_t skip_fill_word(const unsigned char *buf,size_t len,unsigned char fill)
+{
+    const uint64_t fillword=0x0101010101010101ULL*fill;
+    size_t ret=0;
+
+    for (; ret+8<=len; ret+=8)
+    {
+        uint64_t word;
+        memcpy(&word,buf+ret,8);
+        if (word!=fillword)
+        {
+            break;
+        }
+    }
+    while ( (ret<len)&&(buf[ret]==fill) )
+    {
+        ret++;
+    }
+    return ret;
+}
+
+#ifdef BITSCAN_SSE2
+static inline size_t skip_fill_sse2(const unsigned char *buf,size_t len,unsigned char fill)
+{
+    const __m128i fillvec=_mm_set1_epi8((char)fill);
+    size_t ret=0;
+
+    for (; ret+16<=len; ret+=16)
+    {
+        const unsigned int mask=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf+ret)),fillvec));
+        if (mask!=0xffff)
+        {
+            return ret+ctz32(~mask);
+        }
+    }
+    return ret+skip_fill_word(buf+ret,len-ret,fill);
+}
+#endif
+
+#ifdef BITSCAN_AVX2
+__attribute__((target("avx2")))
+static inline size_t skip_fill_avx2(const unsigned char *buf,size_t len,unsigned char fill)
+{
+    const __m256i fillvec=_mm256_set1_epi8((char)fill);
+    size_t ret=0;
+
+    for (; ret+32<=len; ret+=32)
+    {
+        const unsigned int mask=_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf+ret)),fillvec));
+        if (mask!=0xffffffff)
+        {
+            return ret+ctz32(~mask);
+        }
+    }
+    return ret+skip_fill_sse2(buf+ret,len-ret,fill);
+}
+#endif
+
+#endif
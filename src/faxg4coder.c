@@ -16,6 +16,11 @@
 #include "pbm.h"
 #include "g4code.h"
 
+// rows de- resp. encoded at a time, per thread: they are started once per batch
+#define DECODE_ROWS 256
+#define ENCODE_ROWS 256
+#define MAX_THREADS 1024
+
 typedef struct {
     uint8_t sign[3];
     uint8_t flags;
@@ -37,14 +42,30 @@ void usage(const char *name)
            "       -g4: G4 (2-dim) code\n\n"
 
            " mmr:\n"
-           "      -hdr: Put/Read MMR header to file\n\n"
+           "      -hdr: Put/Read MMR header to file\n"
+           " -strips{R}: Encode strips of {R} rows as independent images\n"
+           "            in parallel, needs -hdr (striped MMR format), not with -b\n\n"
 
            " direct:\n"
            "-decode{W}: Decode to pbm-file, using image width {W},\n"
            "            e.g. -decode1728 (default, if not given)\n"
-           "     else : Encode from pbm-file\n\n"
+           "-preview{S}: With -decode: write a grayscale pgm-file scaled\n"
+           "            down by {S} = 2, 4 or 8 instead\n"
+           "-crop X,Y,W,H: With -decode: only decode the {W}x{H} pixels\n"
+           "            at {X},{Y}; stops reading after the last row\n"
+           "-mkindex{N} FILE: Write checkpoints every {N} lines (default: 256)\n"
+           "            while encoding or decoding to the index FILE\n"
+           "-index FILE: With -crop: start decoding at the last checkpoint\n"
+           "            in the index FILE before the region\n"
+           "     else : Encode from pbm-file; concatenated images\n"
+           "            are encoded one after the other\n"
+           "-transcode{W}: Recode from the algorithm given before to the one\n"
+           "            given after (default: -g4), using image width {W},\n"
+           "            e.g. -g3 -transcode1728 -g4; -hdr only with -g4 output\n\n"
 
            " other:\n"
+           "-threads{N}: En-/decode G3 code on {N} threads\n"
+           "            (default: one per cpu)\n"
            "        -b: Read/Write bitstrings\n"
            "        -p: Write plain pbm\n"
            "        -h: Show this help\n\n"
@@ -66,62 +87,728 @@ int wrfunc(void *user,unsigned char *buf,int len)
 int rdfunc(void *user,unsigned char *buf,int len)
 {
     FILE *f=(FILE *)user;
+    int ret=fread(buf,1,len,f);
 
-    return (fread(buf,1,len,f)==len)?0:1;
+    return ( (ret<len)&&(ferror(f)) )?-1:ret;
 }
 
+// bitstrings are converted in blocks of this many bytes
+#define BITS_BLOCK 512
+
 int wrfunc_bits(void *user,unsigned char *buf,int len)
 {
     FILE *f=(FILE *)user;
-    int iA;
-    unsigned char iB;
+    char text[8*BITS_BLOCK];
+    int iA,num;
 
-    for (iA=0; iA<len; iA++)
+    for (iA=0; iA<len; iA+=num)
     {
-        for (iB=0x80; iB>0; iB>>=1)
+        num=(len-iA<BITS_BLOCK)?len-iA:BITS_BLOCK;
+        bits_to_ascii(buf+iA,num,text);
+        if (fwrite(text,1,8*num,f)!=(size_t)(8*num))
         {
-            if (buf[iA]&iB)
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int rdfunc_bits(void *user,unsigned char *buf,int len)
+{
+    FILE *f=(FILE *)user;
+    unsigned char text[8*BITS_BLOCK+1];
+    int done=0,got,num;
+
+    memset(buf,0,len);
+    while (done<8*len)
+    {
+        // at most one character per missing digit: nothing is read ahead
+        num=(8*len-done<8*BITS_BLOCK)?8*len-done:8*BITS_BLOCK;
+        if ((num=fread(text,1,num,f))==0)   // EOF: pad zero
+        {
+            break;
+        }
+        if (ascii_to_bits(text,num,buf,done,8*len-done,&got)<0)
+        {
+            // hand out the complete bytes; the bad character fails the next call
+            done+=got;
+            if (done<8)
             {
-                putc('1',f);
+                return -1;
             }
-            else
+            text[num]=0;
+            ungetc(text[strspn((const char *)text,"01 \r\n\t")],f);
+            return done/8;
+        }
+        done+=got;
+    }
+    return (done+7)/8;
+}
+
+// input file: mapped when it is a regular file, else read through stdio
+typedef struct {
+    FILE *f;
+    MAPFILE *map;
+    size_t pos; // in map
+    READFUNC2 read;
+    long left; // bytes of the current strip (striped MMR format)
+} INPUT;
+
+// returns 0 on success
+int open_input(INPUT *in,const char *filename,int bits)
+{
+    in->f=NULL;
+    in->map=NULL;
+    in->pos=0;
+    in->read=(bits)?rdfunc_bits:rdfunc;
+    in->left=0;
+    if (!bits)   // bitstrings need parsing anyway
+    {
+        in->map=map_file(filename);
+    }
+    if (in->map)
+    {
+        return 0;
+    }
+    if (filename)
+    {
+        if ((in->f=fopen(filename,"rb"))==NULL)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        in->f=stdin;
+#ifdef _WIN32
+        _setmode(_fileno(in->f), _O_BINARY);
+#endif
+    }
+    return 0;
+}
+
+void close_input(INPUT *in)
+{
+    if (in->map)
+    {
+        unmap_file(in->map);
+    }
+    else if (in->f!=stdin)
+    {
+        fclose(in->f);
+    }
+}
+
+// returns 1, if all >len bytes could be read
+int read_input(INPUT *in,void *buf,int len)
+{
+    if (!in->map)
+    {
+        return (fread(buf,1,len,in->f)==len);
+    }
+    if (in->map->len-in->pos<(size_t)len)
+    {
+        return 0;
+    }
+    memcpy(buf,in->map->data+in->pos,len);
+    in->pos+=len;
+    return 1;
+}
+
+// decoder for the rest of the input
+G4STATE *init_input(INPUT *in,int k,int width)
+{
+    if (in->map)
+    {
+        return init_g4_read_mem(k,width,in->map->data+in->pos,in->map->len-in->pos);
+    }
+    return init_g4_read2(k,width,0,in->read,in->f);
+}
+
+int rdfunc_strip(void *user,unsigned char *buf,int len)
+{
+    INPUT *in=(INPUT *)user;
+    int ret;
+
+    if (len>in->left)
+    {
+        len=in->left;
+    }
+    ret=(*in->read)(in->f,buf,len);
+    if (ret>0)
+    {
+        in->left-=ret;
+    }
+    return ret;
+}
+
+// skips the rest of the current strip and sets up a decoder for the next one
+G4STATE *next_strip(G4STATE *gst,INPUT *in,int k,int width)
+{
+    unsigned char size_be[4];
+
+    free_g4(gst);
+    if (in->map)
+    {
+        in->pos+=in->left;
+        in->left=0;
+    }
+    while (in->left>0)   // through >read, like the strip itself
+    {
+        unsigned char skip[256];
+        const int len=(in->left<(long)sizeof(skip))?(int)in->left:(int)sizeof(skip);
+
+        if ((*in->read)(in->f,skip,len)!=len)
+        {
+            return NULL;
+        }
+        in->left-=len;
+    }
+    if (!read_input(in,size_be,4))
+    {
+        return NULL;
+    }
+    in->left=((long)size_be[0]<<24)|(size_be[1]<<16)|(size_be[2]<<8)|size_be[3];
+    if (in->map)   // the strip is a slice of the mapping
+    {
+        if ((size_t)in->left>in->map->len-in->pos)
+        {
+            in->left=in->map->len-in->pos;
+        }
+        return init_g4_read_mem(k,width,in->map->data+in->pos,in->left);
+    }
+    return init_g4_read2(k,width,0,rdfunc_strip,in);
+}
+
+// reads the MMR header for decoding; >rowsperstrip is 0 unless striped
+// returns 0 on success
+int read_mmr_header(INPUT *in,int *width,int *height,int *rowsperstrip,bool *invert_colors)
+{
+    mmr_header_t mmr_header;
+
+    if (!read_input(in, &mmr_header, sizeof(mmr_header_t)))
+    {
+        fprintf(stderr,"Error: Can't read MMR header\n");
+        return -1;
+    }
+
+    if (mmr_header.sign[0] != 'M' || mmr_header.sign[1] != 'M' || mmr_header.sign[2] != 'R' || (mmr_header.flags & 0xfc) != 0)
+    {
+        fprintf(stderr,"Error: corrupted MMR header\n");
+        return -1;
+    }
+    // zero means min_is_white like in pbm files, so conversion needed only if flag is set
+    *invert_colors = ((mmr_header.flags & 0x1) != 0);
+    *width = mmr_header.width_be[0]*256+mmr_header.width_be[1];
+    *height = mmr_header.height_be[0]*256+mmr_header.height_be[1];
+    *rowsperstrip = 0;
+    if (mmr_header.flags & 0x2) { // striped: rows per strip, then each strip as size + independent image
+        unsigned char rows_be[2];
+
+        if ( (!read_input(in, rows_be, 2))||((*rowsperstrip = rows_be[0]*256+rows_be[1]) == 0) )
+        {
+            fprintf(stderr,"Error: corrupted MMR header\n");
+            return -1;
+        }
+        if (in->read==rdfunc_bits)   // not written by -strips
+        {
+            fprintf(stderr,"Error: striped MMR can't be read with -b\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// recodes infile without going through a bitmap
+int transcode(char **files,int kin,int kout,int width,bool need_mmr_header,int bits)
+{
+    G4STATE *dec,*enc;
+    mmr_header_t mmr_header;
+    INPUT in;
+    FILE *out;
+    int ret;
+
+    if ( (need_mmr_header)&&(kout!=-1) )   // the MMR header is only defined for G4
+    {
+        fprintf(stderr,"Error: -hdr needs G4 output\n");
+        return 1;
+    }
+    if (open_input(&in,files[0],bits))
+    {
+        fprintf(stderr,"Error opening \"%s\" for reading: %s\n",files[0], strerror(errno));
+        return 3;
+    }
+    if (need_mmr_header)   // passed on unchanged
+    {
+        if ( (!read_input(&in, &mmr_header, sizeof(mmr_header_t)))||
+             (mmr_header.sign[0] != 'M')||(mmr_header.sign[1] != 'M')||(mmr_header.sign[2] != 'R')||((mmr_header.flags & 0xfe) != 0) )
+        {
+            fprintf(stderr,"Error: corrupted or striped MMR header\n");
+            close_input(&in);
+            return 2;
+        }
+        width = mmr_header.width_be[0]*256+mmr_header.width_be[1];
+    }
+    if (files[1])
+    {
+        if ((out=fopen(files[1],"wb"))==NULL)
+        {
+            fprintf(stderr,"Error opening \"%s\" for writing: %s\n",files[1], strerror(errno));
+            close_input(&in);
+            return 3;
+        }
+    }
+    else
+    {
+        out=stdout;
+#ifdef _WIN32
+        _setmode(_fileno(out), _O_BINARY);
+#endif
+    }
+
+    if ( (need_mmr_header)&&(fwrite(&mmr_header, sizeof(mmr_header_t), 1, out) != 1) )
+    {
+        fprintf(stderr,"Error: can't write MMR header\n");
+        ret=-1;
+    }
+    else
+    {
+        dec=init_input(&in,kin,width);
+        enc=init_g4_write(kout,width,(bits)?wrfunc_bits:wrfunc,out);
+        if ( (!dec)||(!enc) )
+        {
+            fprintf(stderr,"Alloc error: %s\n", strerror(errno));
+            ret=-1;
+        }
+        else if ((ret=transcode_g4(dec,enc))<0)
+        {
+            fprintf(stderr,"Transcoder error: %d\n",ret);
+        }
+        free_g4(dec);
+        free_g4(enc);
+        if (bits)
+        {
+            fprintf(out,"\n");
+        }
+    }
+    close_input(&in);
+    if (files[1])
+    {
+        fclose(out);
+    }
+    return (ret<0)?2:0;
+}
+
+// decodes infile to a pgm of 1/(1<<shift) size, each pixel the average of its block
+int preview(char **files,int k,int width,bool need_mmr_header,int bits,int shift)
+{
+    G4STATE *gst=NULL;
+    INPUT in;
+    bool invert_colors = false;
+    int ret=0,height=0,rowsperstrip=0,gwidth,alloc,rows=0,lines=0,iA,iB;
+    int *sums;
+    unsigned char *gray,*tmp;
+
+    if (open_input(&in,files[0],bits))
+    {
+        fprintf(stderr,"Error opening \"%s\" for reading: %s\n",files[0], strerror(errno));
+        return 3;
+    }
+    if ( (need_mmr_header)&&(read_mmr_header(&in,&width,&height,&rowsperstrip,&invert_colors)) )
+    {
+        close_input(&in);
+        return 2;
+    }
+    gwidth=(width+(1<<shift)-1)>>shift;
+    alloc=(height)?(height+(1<<shift)-1)>>shift:100; // initial alloc
+    sums=calloc(gwidth,sizeof(int));
+    gray=malloc(alloc*gwidth);
+    if (!rowsperstrip)   // else: set up per strip
+    {
+        gst=init_input(&in,k,width);
+    }
+    if ( (!sums)||(!gray)||( (!gst)&&(!rowsperstrip) ) )
+    {
+        fprintf(stderr,"Alloc error: %s\n", strerror(errno));
+        free_g4(gst);
+        close_input(&in);
+        free(sums);
+        free(gray);
+        return 2;
+    }
+    while (!ret)
+    {
+        // sum up the next 1<<shift lines
+        for (iA=0; iA<(1<<shift); iA++,lines++)
+        {
+            if ( (height)&&(lines>=height) )   // done
+            {
+                ret=1;
+                break;
+            }
+            if ( (rowsperstrip)&&(lines%rowsperstrip==0)&&((gst=next_strip(gst,&in,k,width))==NULL) )
+            {
+                fprintf(stderr,"Error: can't read MMR strip\n");
+                ret=-1;
+                break;
+            }
+            if ((ret=decode_g4_sums(gst,sums,shift))!=0)
+            {
+                if (ret<0)
+                {
+                    fprintf(stderr,"Decoder error: %d\n",ret);
+                }
+                break;
+            }
+        }
+        if (!iA)   // nothing left
+        {
+            break;
+        }
+        if (rows>=alloc)
+        {
+            alloc+=alloc;
+            if ((tmp=realloc(gray,alloc*gwidth))==NULL)
             {
-                putc('0',f);
+                fprintf(stderr,"Realloc error: %s\n", strerror(errno));
+                ret=-1;
+                break;
             }
+            gray=tmp;
         }
+        // black pixels of iA lines and up to 1<<shift columns (less at the right edge)
+        tmp=gray+rows*gwidth;
+        for (iB=0; iB<gwidth; iB++)
+        {
+            const int cols=(width-(iB<<shift)<(1<<shift))?width-(iB<<shift):(1<<shift);
+            const int area=cols*iA;
+
+            tmp[iB]=255-(sums[iB]*255+area/2)/area;
+            if (invert_colors)
+            {
+                tmp[iB]=255-tmp[iB];
+            }
+            sums[iB]=0;
+        }
+        rows++;
     }
-    return 0;
+    free_g4(gst);
+    close_input(&in);
+    free(sums);
+    // also the partial result on error
+    iA=write_pgm(files[1],gray,gwidth,rows);
+    free(gray);
+    if (iA)
+    {
+        fprintf(stderr,"PGM writer error: %d\n",iA);
+        return 2;
+    }
+    return (ret<0)?2:0;
 }
 
-int rdfunc_bits(void *user,unsigned char *buf,int len)
+// inverts >height rows of >width pixels; the padding bits stay 0
+void invert_rows(unsigned char *buf,int width,int height)
 {
-    FILE *f=(FILE *)user;
-    int iA,c;
-    unsigned char iB;
+    const int bwidth=(width+7)/8;
+    const unsigned char pad=0xff>>(((width-1)&7)+1);
+    int iA,iB;
+
+    for (iA=0; iA<height; iA++,buf+=bwidth)
+    {
+        for (iB=0; iB<bwidth; iB++)
+        {
+            buf[iB]^=0xff;
+        }
+        buf[bwidth-1]&=~pad;
+    }
+}
+
+// returns 0 on success
+int save_index(const char *filename,const G4INDEX *index)
+{
+    FILE *f;
+    int ret;
+
+    if ((f=fopen(filename,"wb"))==NULL)
+    {
+        fprintf(stderr,"Error opening \"%s\" for writing: %s\n",filename, strerror(errno));
+        return -1;
+    }
+    ret=write_g4_index(index,wrfunc,f);
+    if (fclose(f))
+    {
+        ret=-ERR_WRITE;
+    }
+    if (ret)
+    {
+        fprintf(stderr,"Error writing index: %d\n",ret);
+    }
+    return ret;
+}
+
+G4INDEX *load_index(const char *filename)
+{
+    G4INDEX *ret;
+    FILE *f;
+
+    if ((f=fopen(filename,"rb"))==NULL)
+    {
+        fprintf(stderr,"Error opening \"%s\" for reading: %s\n",filename, strerror(errno));
+        return NULL;
+    }
+    if ((ret=read_g4_index(rdfunc,f))==NULL)
+    {
+        fprintf(stderr,"Error: corrupted index \"%s\"\n",filename);
+    }
+    fclose(f);
+    return ret;
+}
+
+// decodes only the rows >y .. >y+>h-1 and the columns >x .. >x+>w-1 of infile;
+// parsing stops after the last row needed; with an >index it starts at the last checkpoint before
+int crop(char **files,int k,int width,bool need_mmr_header,int bits,int plain,int x,int y,int w,int h,const G4INDEX *index)
+{
+    G4STATE *gst=NULL;
+    INPUT in;
+    bool invert_colors = false;
+    int ret=0,height=0,rowsperstrip=0,cbwidth,line=0,rows=0;
+    unsigned char *buf;
 
-    for (iA=0; iA<len; iA++)
+    if (open_input(&in,files[0],bits))
+    {
+        fprintf(stderr,"Error opening \"%s\" for reading: %s\n",files[0], strerror(errno));
+        return 3;
+    }
+    if ( (need_mmr_header)&&(read_mmr_header(&in,&width,&height,&rowsperstrip,&invert_colors)) )
+    {
+        close_input(&in);
+        return 2;
+    }
+    // clip to the image
+    if (w>width-x)
+    {
+        w=width-x;
+    }
+    if ( (height)&&(h>height-y) )
+    {
+        h=height-y;
+    }
+    if ( (x<0)||(y<0)||(w<=0)||(h<=0) )
+    {
+        fprintf(stderr,"Error: crop region outside of the image\n");
+        close_input(&in);
+        return 1;
+    }
+    cbwidth=(w+7)/8;
+    buf=malloc(h*cbwidth);
+    if (!rowsperstrip)   // else: set up per strip
+    {
+        gst=init_input(&in,k,width);
+    }
+    if ( (!buf)||( (!gst)&&(!rowsperstrip) ) )
+    {
+        fprintf(stderr,"Alloc error: %s\n", strerror(errno));
+        free_g4(gst);
+        close_input(&in);
+        free(buf);
+        return 2;
+    }
+    if ( (index)&&(!rowsperstrip)&&(y>0) )
+    {
+        if ( (index->width!=width)||(index->kval!=k) )
+        {
+            fprintf(stderr,"Warning: index does not match the input, not used\n");
+        }
+        else if ( ((ret=seek_g4(gst,index,y))<0)&&(in.map) )   // else: not seekable, read from the top
+        {
+            fprintf(stderr,"Decoder error: %d\n",ret);
+        }
+        else
+        {
+            line=gst->lines_done;
+            ret=0;
+        }
+    }
+    while ( (!ret)&&(rows<h) )
     {
-        buf[iA]=0;
-        for (iB=0x80; iB>0; iB>>=1)
+        int lines=(line<y)?y-line:h-rows,done;
+
+        if (rowsperstrip)
         {
-            do
+            if ( (line%rowsperstrip==0)&&((gst=next_strip(gst,&in,k,width))==NULL) )
             {
-                c=getc(f);
+                fprintf(stderr,"Error: can't read MMR strip\n");
+                ret=-1;
+                break;
             }
-            while ( (c=='\r')||(c=='\n') );
-            if (c=='1')
+            if (lines>rowsperstrip-line%rowsperstrip)   // rest of the strip
             {
-                buf[iA]|=iB;
+                lines=rowsperstrip-line%rowsperstrip;
             }
-            else if (c==-1)     // EOF: pad zero
+        }
+        if (line<y)   // above the region
+        {
+            // strips above the region are not decoded at all
+            ret=( (rowsperstrip)&&(lines==rowsperstrip) )?lines:skip_g4(gst,lines);
+            if (ret<0)
             {
+                fprintf(stderr,"Decoder error: %d\n",ret);
                 break;
             }
-            else if (c!='0')
+            line+=ret;
+            if (ret<lines)   // done
             {
-                return 1;
+                break;
             }
+            ret=0;
+            continue;
+        }
+        done=gst->lines_done;
+        ret=decode_g4_region(gst,buf+rows*cbwidth,lines,cbwidth,x,w);
+        if (ret<0)
+        {
+            rows+=gst->lines_done-done;
+            fprintf(stderr,"Decoder error: %d\n",ret);
+            break;
         }
+        rows+=ret;
+        line+=ret;
+        if (ret<lines)   // done
+        {
+            break;
+        }
+        ret=0;
+    }
+    free_g4(gst);
+    close_input(&in);
+    if (invert_colors != false)
+    {
+        invert_rows(buf,w,rows);
+    }
+    // also the partial result on error
+    if ( (!rows)&&(ret>=0) )
+    {
+        fprintf(stderr,"Error: crop region outside of the image\n");
+        ret=-1;
+    }
+    else if ( (rows)&&((rows=write_pbm(files[1],buf,w,rows,plain))!=0) )
+    {
+        fprintf(stderr,"PBM writer error: %d\n",rows);
+        ret=-1;
+    }
+    free(buf);
+    return (ret<0)?2:0;
+}
+
+// encodes the current image of >pr to >f, a few rows at a time (striped: the whole image).
+// with >interval, *index gets a checkpoint every >interval rows. returns 0 on success
+static int encode_image(PBMREADER *pr,FILE *f,int k,bool need_mmr_header,int bits,int rowsperstrip,int threads,int interval,G4INDEX **index)
+{
+    const int width=pr->width,height=pr->height,bwidth=(width+7)/8,batch=ENCODE_ROWS*g4_threads(threads);
+    const unsigned char *pixels;
+    G4STATE *gst;
+    int ret=0,rows,iA;
+
+    if (rowsperstrip>height)   // one strip
+    {
+        rowsperstrip=(height>0)?height:1;
+    }
+    if(need_mmr_header) {
+        mmr_header_t mmr_header;
+
+        if (width > UINT16_MAX || height > UINT16_MAX || rowsperstrip > UINT16_MAX)
+        {
+            fprintf(stderr,"Error: image size is too large for MMR header\n");
+            return -1;
+        }
+
+        mmr_header.sign[0] = 'M';
+        mmr_header.sign[1] = 'M';
+        mmr_header.sign[2] = 'R';
+        mmr_header.flags = (rowsperstrip)?0x02:0x00;
+        mmr_header.width_be[0] = width/256;
+        mmr_header.width_be[1] = width%256;
+        mmr_header.height_be[0] = height/256;
+        mmr_header.height_be[1] = height%256;
+
+        if ( (fwrite(&mmr_header, sizeof(mmr_header_t), 1, f) != 1)||
+             ( (rowsperstrip)&&( (putc(rowsperstrip/256, f) == EOF)||(putc(rowsperstrip%256, f) == EOF) ) ) )
+        {
+            fprintf(stderr,"Error: can't write MMR header\n");
+            return -1;
+        }
+    }
+    if (rowsperstrip)   // the strips are coded in parallel
+    {
+        G4STRIPS strips;
+
+        if ((ret=read_pbm_rows(pr,&pixels,height))!=height)
+        {
+            fprintf(stderr,"PBM reader error: %d\n",(ret<0)?ret:-2);
+            return -1;
+        }
+        ret=encode_g4_strips(k,width,pixels,height,bwidth,rowsperstrip,threads,&strips);
+        for (iA=0; (iA<strips.num)&&(!ret); iA++)
+        {
+            const int count=strips.counts[iA];
+            unsigned char size_be[4]= {count>>24,count>>16,count>>8,count};
+
+            if ( (fwrite(size_be,1,4,f)!=4)||(wrfunc(f,strips.data+strips.offsets[iA],count)) )
+            {
+                ret=-ERR_WRITE;
+            }
+        }
+        free_g4_strips(&strips);
+        if (ret)
+        {
+            fprintf(stderr,"Encoder error: %d\n",ret);
+            return -1;
+        }
+        return 0;
+    }
+    gst=init_g4_write(k,width,(bits)?wrfunc_bits:wrfunc,f);
+    if ( (interval)&&(gst) )   // with a checkpoint every >interval rows
+    {
+        *index=new_g4_index(k,width);
+    }
+    if ( (!gst)||( (interval)&&(!*index) ) )
+    {
+        fprintf(stderr,"Alloc error: %s\n", strerror(errno));
+        free_g4(gst);
+        return -1;
+    }
+    for (iA=0; (iA<height)&&(!ret); iA+=rows)
+    {
+        rows=(height-iA<batch)?height-iA:batch;
+        if ( (interval)&&(rows>interval-iA%interval) )
+        {
+            rows=interval-iA%interval;
+        }
+        if ( (interval)&&(iA%interval==0)&&((ret=add_g4_checkpoint(gst,*index))!=0) )
+        {
+            break;
+        }
+        if ((ret=read_pbm_rows(pr,&pixels,rows))!=rows)
+        {
+            fprintf(stderr,"PBM reader error: %d\n",(ret<0)?ret:-2);
+            free_g4(gst);
+            return -1;
+        }
+        ret=encode_g4_parallel(gst,pixels,rows,bwidth,threads);
+    }
+    if (!ret)
+    {
+        ret=encode_g4(gst,NULL);
+    }
+    free_g4(gst);
+    if (bits)
+    {
+        fprintf(f,"\n");
+    }
+    if (ret)
+    {
+        fprintf(stderr,"Encoder error: %d\n",ret);
+        return -1;
     }
     return 0;
 }
@@ -129,10 +816,14 @@ int rdfunc_bits(void *user,unsigned char *buf,int len)
 int main(int argc,char **argv)
 {
     G4STATE *gst;
-    int ret=0,k=0,width = 0,height = 0,plain=0,bits=0;
-    bool need_mmr_header = false, decode = false;
+    int ret=0,k=0,kout=-1,width = 0,height = 0,plain=0,bits=0,threads=0,rowsperstrip=0,shift=0;
+    int crop_x=0,crop_y=0,crop_w=0,crop_h=0,interval=0;
+    char *indexfile=NULL;
+    G4INDEX *index=NULL;
+    int *kset=&k; // -g3/-g4 after -transcode select the output
+    bool need_mmr_header = false, decode = false, recode = false;
     char *files[2]= {NULL,NULL};
-    unsigned char *buf=NULL,*tmp;
+    unsigned char *buf=NULL;
     int iA,iB;
     FILE *f;
 
@@ -144,21 +835,30 @@ int main(int argc,char **argv)
         {
             if (argv[iA][3])
             {
-                k=atoi(argv[iA]+3);
+                *kset=atoi(argv[iA]+3);
             }
             else
             {
-                k=0;
+                *kset=0;
             }
         }
         else if (strcmp(argv[iA],"-g4")==0)
         {
-            k=-1;
+            *kset=-1;
         }
         else if (strcmp(argv[iA],"-hdr")== 0)
         {
             need_mmr_header = true;
         }
+        else if (strncmp(argv[iA],"-strips",7)==0)
+        {
+            rowsperstrip=atoi(argv[iA]+7);
+            if (rowsperstrip<=0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
         else if (strncmp(argv[iA],"-decode",7)==0)
         {
             if (argv[iA][7])
@@ -171,6 +871,44 @@ int main(int argc,char **argv)
             }
             decode = true;
         }
+        else if (strncmp(argv[iA],"-preview",8)==0)
+        {
+            for (shift=1; (shift<=3)&&((1<<shift)!=atoi(argv[iA]+8)); shift++) ;
+            if (shift>3)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[iA],"-crop")==0)
+        {
+            if ( (iA+1>=argc)||(sscanf(argv[++iA],"%d,%d,%d,%d",&crop_x,&crop_y,&crop_w,&crop_h)!=4)||
+                 (crop_x<0)||(crop_y<0)||(crop_w<=0)||(crop_h<=0) )
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if ( (strncmp(argv[iA],"-mkindex",8)==0)||(strcmp(argv[iA],"-index")==0) )
+        {
+            interval=0;
+            if (argv[iA][1]=='m')   // build
+            {
+                interval=(argv[iA][8])?atoi(argv[iA]+8):256;
+            }
+            if ( (iA+1>=argc)||(interval<0)||( (argv[iA][1]=='m')&&(!interval) ) )
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            indexfile=argv[++iA];
+        }
+        else if (strncmp(argv[iA],"-transcode",10)==0)
+        {
+            width=atoi(argv[iA]+10);
+            recode = true;
+            kset=&kout;
+        }
         else if ( (strcmp(argv[iA],"-h")==0)||(strcmp(argv[iA],"--help")==0) )
         {
             usage(argv[0]);
@@ -180,6 +918,14 @@ int main(int argc,char **argv)
         {
             plain=1;
         }
+        else if (strncmp(argv[iA],"-threads",8)==0)
+        {
+            threads=atoi(argv[iA]+8);
+            if (threads>MAX_THREADS)
+            {
+                threads=MAX_THREADS;
+            }
+        }
         else if (strcmp(argv[iA],"-b")==0)
         {
             bits=1;
@@ -195,176 +941,191 @@ int main(int argc,char **argv)
         }
     }
 
-    if (decode != false)   // decode
+    if (recode != false)
     {
-        bool invert_colors = false;
-        int bwidth, processed_height = 0;
-
-        if (files[0])
+        return transcode(files,k,kout,width,need_mmr_header,bits);
+    }
+    else if ( (decode != false)&&(crop_w) )
+    {
+        if ( (indexfile)&&(!interval)&&((index=load_index(indexfile))==NULL) )
         {
-            if ((f=fopen(files[0],"rb"))==NULL)
-            {
-                fprintf(stderr,"Error opening \"%s\" for reading: %s\n",files[0], strerror(errno));
-                return 3;
-            }
+            return 2;
         }
-        else
+        ret=crop(files,k,width,need_mmr_header,bits,plain,crop_x,crop_y,crop_w,crop_h,index);
+        free_g4_index(index);
+        return ret;
+    }
+    else if ( (decode != false)&&(shift) )
+    {
+        return preview(files,k,width,need_mmr_header,bits,shift);
+    }
+    else if (decode != false)   // decode
+    {
+        bool invert_colors = false, striped = false;
+        const int batch=DECODE_ROWS*g4_threads(threads);
+        int bwidth, processed_height = 0;
+        INPUT in;
+        PBMWRITER *out;
+
+        if (open_input(&in,files[0],bits))
         {
-            f=stdin;
-#ifdef _WIN32
-            _setmode(_fileno(f), _O_BINARY);
-#endif
+            fprintf(stderr,"Error opening \"%s\" for reading: %s\n",files[0], strerror(errno));
+            return 3;
         }
 
         if(need_mmr_header) {
-            mmr_header_t mmr_header;
-
-            if (fread(&mmr_header, sizeof(mmr_header_t), 1, f) != 1)
+            if (read_mmr_header(&in, &width, &height, &rowsperstrip, &invert_colors))
             {
-                fprintf(stderr,"Error: Can't read MMR header\n");
+                close_input(&in);
                 return 2;
             }
-
-            if (mmr_header.sign[0] != 'M' || mmr_header.sign[1] != 'M' || mmr_header.sign[2] != 'R' || (mmr_header.flags & 0xfc) != 0)
-            {
-                fprintf(stderr,"Error: corrupted MMR header\n");
-                if (files[0])
-                {
-                    fclose(f);
-                }
-                return 2;
-            }
-            if (mmr_header.flags & 0x1) { // zero means min_is_white like in pbm files, so conversion needed only if flag is set
-                invert_colors = true;
-            }
-            if (mmr_header.flags & 0x2) {
-                fprintf(stderr,"Error: stripped data format for G4/MMR is unsupported\n");
-                if (files[0])
-                {
-                    fclose(f);
-                }
-                return 2;
-            }
-            width = mmr_header.width_be[0]*256+mmr_header.width_be[1];
-            height = mmr_header.height_be[0]*256+mmr_header.height_be[1];
+            striped = (rowsperstrip != 0);
+        }
+        if ( (interval)&&(striped) )
+        {
+            fprintf(stderr,"Error: no index for striped MMR\n");
+            close_input(&in);
+            return 1;
         }
 
         bwidth=(width+7)/8;
-
-        if (height == 0)
+        buf=malloc((size_t)batch*bwidth);
+        if (!buf)
+        {
+            fprintf(stderr,"Malloc failed: %s\n", strerror(errno));
+            close_input(&in);
+            return 2;
+        }
+        if (striped)   // set up per strip
         {
-            iA=100; // initial alloc
+            gst=NULL;
         }
         else
         {
-            iA = height; // initial alloc
+            gst=init_input(&in,k,width);
         }
-
-        buf=malloc(iA*bwidth);
-        if (!buf)
+        if (interval)
         {
-            fprintf(stderr,"Malloc failed: %s\n", strerror(errno));
-            if (files[0])
-            {
-                fclose(f);
-            }
-            return 2;
+            index=new_g4_index(k,width);
         }
-        gst=init_g4_read(k,width,(bits)?rdfunc_bits:rdfunc,f);
-        if (!gst)
+        if ( ( (!gst)&&(!striped) )||( (interval)&&(!index) ) )
         {
             fprintf(stderr,"Alloc error: %s\n", strerror(errno));
-            if (files[0])
-            {
-                fclose(f);
-            }
+            free_g4(gst);
+            free_g4_index(index);
+            close_input(&in);
             free(buf);
             return 2;
         }
-        while (1)
+        if ((out=open_pbm_writer(files[1],width,height,plain))==NULL)
         {
-            if (processed_height>=iA)
+            fprintf(stderr,"Error opening \"%s\" for writing: %s\n",(files[1])?files[1]:"-", strerror(errno));
+            free_g4(gst);
+            free_g4_index(index);
+            close_input(&in);
+            free(buf);
+            return 3;
+        }
+        // decode a few rows at a time, straight to the output
+        while ( (height==0)||(processed_height<height) )
+        {
+            if ( (striped)&&(processed_height%rowsperstrip==0)&&((gst=next_strip(gst,&in,k,width))==NULL) )
+            {
+                fprintf(stderr,"Error: can't read MMR strip\n");
+                ret=-1;
+            }
+            if (!ret)
             {
-                iA+=iA;
-                tmp=realloc(buf,iA*bwidth);
-                if (!tmp)
+                // as many rows as fit into buf (resp. the current strip)
+                int rows=batch,done=gst->lines_done;
+
+                if ( (height)&&(rows>height-processed_height) )
                 {
-                    fprintf(stderr,"Realloc error: %s\n", strerror(errno));
-                    ret=-1;
+                    rows=height-processed_height;
                 }
-                else
+                if ( (striped)&&(rows>rowsperstrip-processed_height%rowsperstrip) )
                 {
-                    buf=tmp;
+                    rows=rowsperstrip-processed_height%rowsperstrip;
                 }
-            }
-            if (!ret)
-            {
-                ret=decode_g4(gst,buf+processed_height*bwidth);
-                if (ret==1)   // done
+                if ( (index)&&(rows>interval-done%interval) )   // up to the next checkpoint
                 {
-                    break;
+                    rows=interval-done%interval;
                 }
-                else if (ret<0)
+                if ( (index)&&(done%interval==0)&&(add_g4_checkpoint(gst,index)) )
                 {
+                    fprintf(stderr,"Alloc error: %s\n", strerror(errno));
+                    ret=-1;
+                    rows=0;
+                }
+                else if ((ret=decode_g4_parallel(gst,buf,rows,bwidth,threads))<0)
+                {
+                    rows=gst->lines_done-done;   // the partial result
                     fprintf(stderr,"Decoder error: %d\n",ret);
                 }
-            }
-            if (ret)   // error
-            {
-                // Try to write partial result
-                free_g4(gst);
-                if (files[0])
+                else
                 {
-                    fclose(f);
+                    const int want=rows;
+                    rows=ret;
+                    ret=(rows<want)?1:0;   // 1: End-Of-File
                 }
-                ret=write_pbm(files[1],buf,width,processed_height,plain);
-                if (ret)
+                if (invert_colors)
                 {
-                    fprintf(stderr,"PBM writer error: %d\n",ret);
+                    invert_rows(buf,width,rows);
+                }
+                processed_height+=rows;
+                if (write_pbm_rows(out,buf,rows))
+                {
+                    fprintf(stderr,"PBM writer error: %s\n", strerror(errno));
+                    ret=-1;
                 }
-                free(buf);
-                return 2;
             }
-            processed_height++;
+            if (ret)   // error resp. done
+            {
+                break;
+            }
         }
         free_g4(gst);
-        if (files[0])
+        close_input(&in);
+        free(buf);
+        if (ret>0)
         {
-            fclose(f);
+            ret=0;
         }
-        if (invert_colors != false)
+        if ( (!ret)&&(index)&&(save_index(indexfile,index)) )
         {
-            int x, y;
-            unsigned char *p;
-
-            p = buf;
-            for (y = 0; y < height; y++) {
-                for (x = 0; x < width; x++) {
-                    unsigned char b;
-
-                    b = *p;
-                    b = b?0:255;
-                    *p = b;
-
-                    p++;
-                }
-            }
+            ret=-1;
         }
-        if (height == 0)
+        free_g4_index(index);
+        if (close_pbm_writer(out))
         {
-            height = processed_height;
+            fprintf(stderr,"PBM writer error: %s\n", strerror(errno));
+            return 2;
         }
-        ret=write_pbm(files[1],buf,width,height,plain);
-        free(buf);
-        if (ret)
+        if (ret<0)
         {
-            fprintf(stderr,"PBM writer error: %d\n",ret);
             return 2;
         }
     }
     else     // encode
     {
-        ret=read_pbm(files[0],&buf,&width,&height);
+        PBMREADER *pr;
+
+        if ( (rowsperstrip)&&(!need_mmr_header) )
+        {
+            fprintf(stderr,"Error: -strips needs -hdr\n");
+            return 1;
+        }
+        if ( (rowsperstrip)&&(bits) )   // the strip sizes are binary
+        {
+            fprintf(stderr,"Error: -strips can't be used with -b\n");
+            return 1;
+        }
+        if ( (rowsperstrip)&&(interval) )
+        {
+            fprintf(stderr,"Error: no index for striped MMR\n");
+            return 1;
+        }
+        ret=open_pbm_reader(files[0],&pr);
         if (ret)
         {
             fprintf(stderr,"PBM reader error: %d\n",ret);
@@ -375,7 +1136,7 @@ int main(int argc,char **argv)
             if ((f=fopen(files[1],"wb"))==NULL)
             {
                 fprintf(stderr,"Error opening \"%s\" for writing: %s\n",files[1], strerror(errno));
-                free(buf);
+                close_pbm_reader(pr);
                 return 3;
             }
         }
@@ -386,86 +1147,45 @@ int main(int argc,char **argv)
             _setmode(_fileno(f), _O_BINARY);
 #endif
         }
-        if(need_mmr_header) {
-            mmr_header_t mmr_header;
-
-            if (width > UINT16_MAX || height > UINT16_MAX)
-            {
-                fprintf(stderr,"Error: image size is too large for MMR header\n");
-                free(buf);
-                if (files[1])
-                {
-                    fclose(f);
-                }
-                return 2;
-            }
-
-            mmr_header.sign[0] = 'M';
-            mmr_header.sign[1] = 'M';
-            mmr_header.sign[2] = 'R';
-            mmr_header.flags = 0x00;
-            mmr_header.width_be[0] = width/256;
-            mmr_header.width_be[1] = width%256;
-            mmr_header.height_be[0] = height/256;
-            mmr_header.height_be[1] = height%256;
-
-            if (fwrite(&mmr_header, sizeof(mmr_header_t), 1, f) != 1)
+        // concatenated images give one stream after the other
+        for (iA=0; !ret; iA++)
+        {
+            if ( (iA>0)&&((ret=next_pbm_image(pr))!=0) )
             {
-                fprintf(stderr,"Error: can't write MMR header\n");
-                free(buf);
-                if (files[1])
+                if (ret<0)   // trailing garbage: keep what we have
                 {
-                    fclose(f);
+                    fprintf(stderr,"Warning: ignoring data after image %d (PBM reader error: %d)\n",iA,ret);
+                    ret=0;
                 }
-                return 2;
-            }
-        }
-        gst=init_g4_write(k,width,(bits)?wrfunc_bits:wrfunc,f);
-        if (!gst)
-        {
-            fprintf(stderr,"Alloc error: %s\n", strerror(errno));
-            free(buf);
-            if (files[1])
-            {
-                fclose(f);
+                break;
             }
-            return 2;
-        }
-        // encode
-        {
-            const int bwidth=(width+7)/8;
-            for (iA=0; iA<height; iA++)
+            if ( (iA>0)&&(index) )
             {
-                ret=encode_g4(gst,buf+bwidth*iA);
-                if (ret)
-                {
-                    fprintf(stderr,"Encoder error: %d\n",ret);
-                    free(buf);
-                    free_g4(gst);
-                    if (files[1])
-                    {
-                        fclose(f);
-                    }
-                    return 2;
-                }
+                fprintf(stderr,"Error: no index for multiple images\n");
+                ret=-1;
+                break;
             }
+            ret=encode_image(pr,f,k,need_mmr_header,bits,rowsperstrip,threads,interval,&index);
         }
-        free(buf);
-        ret=encode_g4(gst,NULL);
-        free_g4(gst);
-        if (bits)
-        {
-            fprintf(f,"\n");
-        }
+        close_pbm_reader(pr);
         if (files[1])
         {
             fclose(f);
         }
-        if (ret)
+        if (ret<0)
         {
-            fprintf(stderr,"Encoder error: %d\n",ret);
+            free_g4_index(index);
             return 2;
         }
+        if (index)
+        {
+            ret=save_index(indexfile,index);
+            free_g4_index(index);
+            if (ret)
+            {
+                return 2;
+            }
+        }
     }
     return 0;
 }
@@ -49,22 +49,6 @@ int rdfunc(void *user,unsigned char *buf,int len)
     return (fread(buf,1,len,f)==len)?0:1;
 }
 
-int wrfunc_mem(void *user,unsigned char *buf,int len)
-{
-    char **tmp=(char **)user;
-    memcpy(*tmp,buf,len);
-    *tmp+=len;
-    return 0;
-}
-
-int rdfunc_mem(void *user,unsigned char *buf,int len)
-{
-    char **tmp=(char **)user;
-    memcpy(buf,*tmp,len);
-    *tmp+=len;
-    return 0;
-}
-
 int wrfunc_bits(void *user,unsigned char *buf,int len)
 {
     FILE *f=(FILE *)user;
@@ -95,14 +79,30 @@ int wrfunc_bits(void *user,unsigned char *buf,int len)
     return 0;
 }
 
+// closes the input of main(): a mapping or a stream
+void close_input(FILE *f,MAPFILE *map)
+{
+    if (map)
+    {
+        unmap_file(map);
+    }
+    else if (f!=stdin)
+    {
+        fclose(f);
+    }
+}
+
 int main(int argc,char **argv)
 {
     LZWSTATE *lzw;
+    PBMWRITER *out=NULL;
     int ret=0,width,height,early=-1,decode=0,pbm=0;
     char *files[2]= {NULL,NULL};
-    unsigned char *buf=NULL,*tmp;
+    unsigned char *buf=NULL;
+    const unsigned char *in=NULL;
     int iA,iB;
     FILE *f=NULL,*g=NULL; // avoid warning
+    MAPFILE *map=NULL;
 
     // parse commandline
     iB=0;
@@ -158,7 +158,8 @@ int main(int argc,char **argv)
 #define BUFSIZE 4096
     if (decode!=0)
     {
-        if (files[0])
+        map=map_file(files[0]); // else: buffered reads
+        if ( (!map)&&(files[0]) )
         {
             if ((f=fopen(files[0],"rb"))==NULL)
             {
@@ -166,7 +167,7 @@ int main(int argc,char **argv)
                 return 2;
             }
         }
-        else
+        else if (!map)
         {
             f=stdin;
 #ifdef _WIN32
@@ -176,17 +177,20 @@ int main(int argc,char **argv)
         if (pbm)
         {
             width=(pbm+7)/8;
-            iA=100; // initial alloc
-            buf=malloc(iA*width);
+            buf=malloc(width); // one row
             if (!buf)
             {
                 fprintf(stderr,"Malloc failed: %s\n", strerror(errno));
-                if (files[0])
-                {
-                    fclose(f);
-                }
+                close_input(f,map);
                 return 2;
             }
+            if ((out=open_pbm_writer(files[1],pbm,0,0))==NULL)
+            {
+                fprintf(stderr,"Error opening \"%s\" for writing: %s\n",(files[1])?files[1]:"-", strerror(errno));
+                free(buf);
+                close_input(f,map);
+                return 3;
+            }
         }
         else
         {
@@ -194,10 +198,7 @@ int main(int argc,char **argv)
             if (!buf)
             {
                 fprintf(stderr,"Malloc failed: %s\n", strerror(errno));
-                if (files[0])
-                {
-                    fclose(f);
-                }
+                close_input(f,map);
                 return 2;
             }
             if (files[1])
@@ -205,10 +206,7 @@ int main(int argc,char **argv)
                 if ((g=fopen(files[1],"wb"))==NULL)
                 {
                     fprintf(stderr,"Error opening \"%s\" for writing: %s\n",files[1], strerror(errno));
-                    if (files[0])
-                    {
-                        fclose(f);
-                    }
+                    close_input(f,map);
                     return 3;
                 }
             }
@@ -220,43 +218,35 @@ int main(int argc,char **argv)
 #endif
             }
         }
-        lzw=init_lzw_read(early,rdfunc,f);
+        if (map)
+        {
+            lzw=init_lzw_read_mem(early,map->data,map->len);
+        }
+        else
+        {
+            lzw=init_lzw_read(early,rdfunc,f);
+        }
         if (!lzw)
         {
             fprintf(stderr,"Alloc error: %s\n", strerror(errno));
             free(buf);
-            if (files[0])
+            close_input(f,map);
+            if (pbm)
             {
-                fclose(f);
+                close_pbm_writer(out);
             }
-            if ( (!pbm)&&(files[1]) )
+            else if (files[1])
             {
                 fclose(g);
             }
             return 2;
         }
         // decode
-        if (pbm)
+        if (pbm)   // row by row, straight to the output
         {
-            height=0;
             while (1)
             {
-                if (height>=iA)
-                {
-                    iA+=iA;
-                    tmp=realloc(buf,iA*width);
-                    if (!tmp)
-                    {
-                        fprintf(stderr,"Realloc error: %s\n", strerror(errno));
-                        ret=-1;
-                        break;
-                    }
-                    else
-                    {
-                        buf=tmp;
-                    }
-                }
-                ret=decode_lzw(lzw,buf+height*width,width);
+                ret=decode_lzw(lzw,buf,width);
                 if (ret>0)   // done
                 {
                     if (ret!=1)
@@ -270,7 +260,12 @@ int main(int argc,char **argv)
                     fprintf(stderr,"Decoder error: %d\n",ret);
                     break;
                 }
-                height++;
+                if (write_pbm_rows(out,buf,1))
+                {
+                    fprintf(stderr,"PBM writer error: %s\n", strerror(errno));
+                    ret=-1;
+                    break;
+                }
             }
         }
         else
@@ -280,11 +275,12 @@ int main(int argc,char **argv)
                 ret=decode_lzw(lzw,buf,BUFSIZE);
                 if (ret>0)   // done
                 {
-                    int len=ret-1;
-                    ret=fwrite(buf,1,len,g);
-                    if (ret!=len)
+                    size_t len=ret-1;
+                    ret=0;
+                    if (fwrite(buf,1,len,g)!=len)
                     {
                         fprintf(stderr,"Write error: %s\n", strerror(errno));
+                        ret=-1;
                     }
                     break;
                 }
@@ -293,25 +289,21 @@ int main(int argc,char **argv)
                     fprintf(stderr,"Decoder error: %d\n",ret);
                     break;
                 }
-                ret=fwrite(buf,1,BUFSIZE,g);
-                if (ret!=BUFSIZE)
+                if (fwrite(buf,1,BUFSIZE,g)!=BUFSIZE)
                 {
                     fprintf(stderr,"Write error: %s\n", strerror(errno));
+                    ret=-1;
                     break;
                 }
             }
         }
         free_lzw(lzw);
-        if (files[0])
-        {
-            fclose(f);
-        }
+        close_input(f,map);
         if (pbm)
         {
-            ret=write_pbm(files[1],buf,pbm,height,0);
-            if (ret)
+            if (close_pbm_writer(out))
             {
-                fprintf(stderr,"PBM writer error: %d\n",ret);
+                fprintf(stderr,"PBM writer error: %s\n", strerror(errno));
                 free(buf);
                 return 2;
             }
@@ -321,18 +313,26 @@ int main(int argc,char **argv)
             fclose(g);
         }
         free(buf);
+        if (ret<0)   // decoder resp. write error, reported above
+        {
+            return 2;
+        }
     }
     else     // encode
     {
         if (pbm!=0)
         {
-            ret=read_pbm(files[0],&buf,&width,&height);
+            ret=map_pbm(files[0],&map,&in,&width,&height);
             if (ret)
             {
                 fprintf(stderr,"PBM reader error: %d\n",ret);
                 return 2;
             }
         }
+        else if ((map=map_file(files[0]))!=NULL)   // encode straight from the mapping
+        {
+            in=map->data;
+        }
         else
         {
             buf=malloc(BUFSIZE);
@@ -364,10 +364,7 @@ int main(int argc,char **argv)
             {
                 fprintf(stderr,"Error opening \"%s\" for writing: %s\n",files[1], strerror(errno));
                 free(buf);
-                if ( (!pbm)&&(files[0]) )
-                {
-                    fclose(f);
-                }
+                close_input(f,map);
                 return 3;
             }
         }
@@ -378,16 +375,19 @@ int main(int argc,char **argv)
             _setmode(_fileno(g), _O_BINARY);
 #endif
         }
-//    lzw=init_lzw_write(1,wrfunc_mem,&tmp);
-        lzw=init_lzw_write(early,wrfunc,g);
+        if (pbm)   // all in memory: collect the output, write it at once
+        {
+            lzw=init_lzw_write_mem(early);
+        }
+        else
+        {
+            lzw=init_lzw_write(early,wrfunc,g);
+        }
         if (!lzw)
         {
             fprintf(stderr,"Alloc error: %s\n", strerror(errno));
             free(buf);
-            if ( (!pbm)&&(files[0]) )
-            {
-                fclose(f);
-            }
+            close_input(f,map);
             if (files[1])
             {
                 fclose(g);
@@ -397,7 +397,26 @@ int main(int argc,char **argv)
         // encode
         if (pbm)
         {
-            ret=encode_lzw(lzw,buf,(width+7)/8*height);
+            ret=encode_lzw(lzw,in,(width+7)/8*height);
+            if (!ret)
+            {
+                ret=encode_lzw(lzw,NULL,0);
+            }
+            if (!ret)
+            {
+                int len;
+                unsigned char *out=take_lzw_mem(lzw,&len);
+                if (fwrite(out,1,len,g)!=len)
+                {
+                    fprintf(stderr,"Write error: %s\n", strerror(errno));
+                    ret=-1;
+                }
+                free(out);
+            }
+        }
+        else if (map)
+        {
+            ret=encode_lzw(lzw,in,map->len);
         }
         else
         {
@@ -412,15 +431,12 @@ int main(int argc,char **argv)
             }
         }
         free(buf);
-        if (!ret)
+        if ( (!ret)&&(!pbm) )
         {
             ret=encode_lzw(lzw,NULL,0);
         }
         free_lzw(lzw);
-        if ( (!pbm)&&(files[0]) )
-        {
-            fclose(f);
-        }
+        close_input(f,map);
         if (files[1])
         {
             fclose(g);
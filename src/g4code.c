@@ -1,11 +1,100 @@
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 #include "g4code.h"
 #include "tables.h"
+#include "bitscan.h"
+
+// 1: encode_g4_parallel uses pthreads (resp. win32 threads)
+// 0: everything runs in the calling thread
+#ifndef G4_THREADS
+#define G4_THREADS 1
+#endif
+#if G4_THREADS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#endif
+
+// the line coders are forced inline into the per-code row loops (see G4_ROWS)
+#if defined(__GNUC__)
+#define G4_INLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define G4_INLINE static __forceinline
+#else
+#define G4_INLINE static inline
+#endif
+
+#define G4_DEFAULT_BUFSIZE 4096
+#define G4_MIN_BUFSIZE 8
+// memory sink: >buflen+4 must stay representable as int
+#define G4_MAX_MEMSIZE (INT_MAX-4)
+
+// 1: decode with single-lookup tables generated from whitehuff/blackhuff/opcode (see init_wide_tables)
+// 0: walk the 6bit (resp. 4bit) tables from tables.h
+#ifndef G4_WIDE_TABLES
+#define G4_WIDE_TABLES 1
+#endif
+
+#if G4_WIDE_TABLES
+static void init_wide_tables(void);
+#endif
+static void init_runcode_table(void);
+
+// set once, by fill_tables
+static size_t (*skip_fill)(const unsigned char *buf,size_t len,unsigned char fill)=skip_fill_word;
+
+static void fill_tables(void)
+{
+#if defined(BITSCAN_AVX2)
+    __builtin_cpu_init();
+    skip_fill=(__builtin_cpu_supports("avx2"))?skip_fill_avx2:skip_fill_sse2;
+#elif defined(BITSCAN_SSE2)
+    skip_fill=skip_fill_sse2;
+#endif
+#if G4_WIDE_TABLES
+    init_wide_tables();
+#endif
+    init_runcode_table();
+}
+
+#if G4_THREADS&&defined(_WIN32)
+static INIT_ONCE tables_once=INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK fill_tables_once(PINIT_ONCE once,PVOID param,PVOID *context)
+{
+    fill_tables();
+    return TRUE;
+}
+#elif G4_THREADS
+static pthread_once_t tables_once=PTHREAD_ONCE_INIT;
+#endif
+
+// fills the tables on first use; safe to call from any thread
+static void init_tables(void)
+{
+#if G4_THREADS&&defined(_WIN32)
+    InitOnceExecuteOnce(&tables_once,fill_tables_once,NULL,NULL);
+#elif G4_THREADS
+    pthread_once(&tables_once,fill_tables);
+#else
+    static int done=0;
+
+    if (!done)
+    {
+        fill_tables();
+        done=1;
+    }
+#endif
+}
 
 // init functions
-G4STATE *init_g4(int kval,int width,READFUNC rf,WRITEFUNC wf,void *user_read,void *user_write)
+// >bufsize==0: no buffer (memory source)
+G4STATE *init_g4(int kval,int width,int encoding,int bufsize)
 {
     G4STATE *ret;
 
@@ -14,15 +103,18 @@ G4STATE *init_g4(int kval,int width,READFUNC rf,WRITEFUNC wf,void *user_read,voi
         width=1728;
     }
 
+    init_tables();
+
     ret=malloc(sizeof(G4STATE));
     if (!ret)
     {
         return NULL;
     }
-    ret->read=rf;
-    ret->write=wf;
-    ret->user_read=user_read;
-    ret->user_write=user_write;
+    ret->read=NULL;
+    ret->read_old=NULL;
+    ret->write=NULL;
+    ret->user_read=NULL;
+    ret->user_write=NULL;
     ret->width=width;
     ret->kval=kval;
     ret->lastline=malloc(sizeof(int)*(width+2));
@@ -38,28 +130,154 @@ G4STATE *init_g4(int kval,int width,READFUNC rf,WRITEFUNC wf,void *user_read,voi
         free(ret);
         return NULL;
     }
+    ret->buf=NULL;
+    if (bufsize>0)
+    {
+        ret->buf=malloc(bufsize);
+        if (!ret->buf)
+        {
+            free(ret->curline);
+            free(ret->lastline);
+            free(ret);
+            return NULL;
+        }
+    }
+    ret->lastrow=NULL;
+    if (encoding)
+    {
+        ret->lastrow=malloc((width+7)/8);
+        if (!ret->lastrow)
+        {
+            free(ret->buf);
+            free(ret->curline);
+            free(ret->lastline);
+            free(ret);
+            return NULL;
+        }
+    }
+    ret->bufsize=bufsize;
+    ret->buflen=ret->bufpos=0;
+    ret->bufstart=0;
+    ret->bitpos=0;
+    ret->bitbuf=0;
+    ret->encoding=encoding;
+    ret->mem=0;
     restart_g4(ret);
     return ret;
 }
 
+static int g4_bufsize(int bufsize)
+{
+    if (bufsize<=0)
+    {
+        return G4_DEFAULT_BUFSIZE;
+    }
+    return (bufsize<G4_MIN_BUFSIZE)?G4_MIN_BUFSIZE:bufsize;
+}
+
 G4STATE *init_g4_read(int kval,int width,READFUNC rf,void *user_read)
 {
+    G4STATE *ret;
+
     assert(rf);
     if (!rf)
     {
         return 0;
     }
-    return init_g4(kval,width,rf,NULL,user_read,NULL);
+    if ((ret=init_g4(kval,width,0,G4_MIN_BUFSIZE))!=NULL)
+    {
+        ret->read_old=rf;
+        ret->user_read=user_read;
+    }
+    return ret;
 }
 
 G4STATE *init_g4_write(int kval,int width,WRITEFUNC wf,void *user_write)
 {
+    return init_g4_write2(kval,width,0,wf,user_write);
+}
+
+G4STATE *init_g4_read2(int kval,int width,int bufsize,READFUNC2 rf,void *user_read)
+{
+    G4STATE *ret;
+
+    assert(rf);
+    if (!rf)
+    {
+        return 0;
+    }
+    if ((ret=init_g4(kval,width,0,g4_bufsize(bufsize)))!=NULL)
+    {
+        ret->read=rf;
+        ret->user_read=user_read;
+    }
+    return ret;
+}
+
+G4STATE *init_g4_write2(int kval,int width,int bufsize,WRITEFUNC wf,void *user_write)
+{
+    G4STATE *ret;
+
     assert(wf);
     if (!wf)
     {
         return 0;
     }
-    return init_g4(kval,width,NULL,wf,NULL,user_write);
+    if ((ret=init_g4(kval,width,1,g4_bufsize(bufsize)))!=NULL)
+    {
+        ret->write=wf;
+        ret->user_write=user_write;
+    }
+    return ret;
+}
+
+G4STATE *init_g4_read_mem(int kval,int width,const unsigned char *buf,int len)
+{
+    G4STATE *ret;
+
+    assert( (buf)||(len==0) );
+    if ( (!buf)&&(len!=0) )
+    {
+        return 0;
+    }
+    if ((ret=init_g4(kval,width,0,0))!=NULL)
+    {
+        ret->mem=1;
+        ret->buf=(unsigned char *)buf; // only read
+        ret->bufsize=ret->buflen=len;
+    }
+    return ret;
+}
+
+G4STATE *init_g4_write_mem(int kval,int width,int bufsize)
+{
+    G4STATE *ret;
+
+    if ((ret=init_g4(kval,width,1,g4_bufsize(bufsize)))!=NULL)
+    {
+        ret->mem=1;
+    }
+    return ret;
+}
+
+unsigned char *take_g4_mem(G4STATE *state,int *len)
+{
+    unsigned char *ret;
+
+    assert(state);
+    if ( (!state)||(!state->encoding)||(!state->mem) )
+    {
+        return NULL;
+    }
+    ret=state->buf;
+    if (len)
+    {
+        *len=state->buflen;
+    }
+    state->buf=NULL; // grows again from scratch
+    state->bufstart+=state->buflen;
+    state->bufsize=state->buflen=0;
+    return ret;
 }
 
 void restart_g4(G4STATE *state)
@@ -69,9 +287,22 @@ void restart_g4(G4STATE *state)
     {
         memset(state->lastline,0,sizeof(int)*(state->width+2));
         state->lastline[0]=state->width;
+        if (state->lastrow)   // the reference line is white
+        {
+            memset(state->lastrow,0,(state->width+7)/8);
+        }
+        state->lastrow_ok=1;
         state->lines_done=0;
-        state->bitpos=0;
-        state->bitbuf=0;
+        if (!state->encoding)   // drop the rest of the current byte, keep what is read ahead
+        {
+            state->bitbuf<<=state->bitpos&7;
+            state->bitpos&=~7;
+        }
+        else
+        {
+            state->bitpos=0;
+            state->bitbuf=0;
+        }
     }
 }
 
@@ -81,105 +312,250 @@ void free_g4(G4STATE *state)
     {
         free(state->lastline);
         free(state->curline);
+        if ( (state->encoding)||(!state->mem) )   // not the caller's input
+        {
+            free(state->buf);
+        }
+        free(state->lastrow);
         free(state);
     }
 }
 
 // helper functions
-int writecode(G4STATE *state,ENCHUFF *table,int code)
+// hand the collected output to >write
+// (memory sink: make room for at least 4 more bytes instead)
+int writebuf(G4STATE *state)
 {
-    unsigned char buf[4];
-    int iA=0;
+    int ret;
 
-    // TODO? make tables LSB-aligned(or ints)
-    state->bitbuf|=(unsigned)(table[code].bits<<16)>>state->bitpos;
-    state->bitpos+=table[code].len;
-    while (state->bitpos>=8)
+    if (state->mem)
     {
-        buf[iA++]=state->bitbuf>>24;
-        state->bitbuf<<=8;
-        state->bitpos-=8;
+        unsigned char *tmp;
+        int size;
+        if (state->buflen+4<=state->bufsize)
+        {
+            return 0;
+        }
+        if (state->bufsize>=G4_MAX_MEMSIZE)
+        {
+            return -ERR_WRITE;
+        }
+        else if (state->bufsize>G4_MAX_MEMSIZE/2)
+        {
+            size=G4_MAX_MEMSIZE;
+        }
+        else
+        {
+            size=(state->bufsize>0)?2*state->bufsize:G4_DEFAULT_BUFSIZE;
+        }
+        tmp=realloc(state->buf,size);
+        if (!tmp)
+        {
+            return -ERR_WRITE;
+        }
+        state->buf=tmp;
+        state->bufsize=size;
+        return 0;
     }
-    if (!iA)
+    if (!state->buflen)
     {
         return 0;
     }
-    return (*state->write)(state->user_write,buf,iA);
+    ret=(*state->write)(state->user_write,state->buf,state->buflen);
+    state->bufstart+=state->buflen;
+    state->buflen=0;
+    return ret;
 }
 
-int writeflush(G4STATE *state)
+// append the lower >len bits of >bits; 0<len<=32
+static inline int putbits(G4STATE *state,unsigned int bits,int len)
+{
+    state->bitbuf|=(uint64_t)bits<<(64-len-state->bitpos);
+    state->bitpos+=len;
+    if (state->bitpos>=32)
+    {
+        unsigned char *out;
+        if (state->buflen+4>state->bufsize)
+        {
+            int ret=writebuf(state);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+        out=state->buf+state->buflen;
+        out[0]=state->bitbuf>>56;
+        out[1]=state->bitbuf>>48;
+        out[2]=state->bitbuf>>40;
+        out[3]=state->bitbuf>>32;
+        state->buflen+=4;
+        state->bitbuf<<=32;
+        state->bitpos-=32;
+    }
+    return 0;
+}
+
+int writecode(G4STATE *state,ENCHUFF *table,int code)
 {
-    unsigned char buf[4];
-    int iA=0;
+    // TODO? make tables LSB-aligned(or ints)
+    return putbits(state,table[code].bits>>(16-table[code].len),table[code].len);
+}
 
+// "pad to byte boundary" and pass everything to >write
+int writeflush(G4STATE *state)
+{
     while (state->bitpos>0)
     {
-        buf[iA++]=state->bitbuf>>24;
+        if (state->buflen>=state->bufsize)
+        {
+            int ret=writebuf(state);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+        state->buf[state->buflen++]=state->bitbuf>>56;
         state->bitbuf<<=8;
         state->bitpos-=8;
     }
     state->bitpos=0;
-    if (!iA)
+    state->bitbuf=0;
+    return writebuf(state);
+}
+
+// Complete code (makeup+terminating) for runs 0..2559: (bits<<5)|len, bits LSB-aligned, len<=25
+static unsigned int runcodetable[2][2560];
+
+// called once, by init_tables
+static void init_runcode_table(void)
+{
+    const ENCHUFF *colorhuff[]= {whitehuff,blackhuff};
+    int black,num;
+
+    for (black=0; black<2; black++)
     {
-        return 0;
+        for (num=0; num<2560; num++)
+        {
+            const ENCHUFF *term=&colorhuff[black][num%64];
+            unsigned int bits=term->bits>>(16-term->len),len=term->len;
+            if (num>=64)
+            {
+                const ENCHUFF *makeup=&colorhuff[black][63+num/64];
+                bits|=(makeup->bits>>(16-makeup->len))<<len;
+                len+=makeup->len;
+            }
+            runcodetable[black][num]=(bits<<5)|len;
+        }
     }
-    return (*state->write)(state->user_write,buf,iA);
 }
 
-int writehuff(G4STATE *state,int black,int num)
+G4_INLINE int writehuff(G4STATE *state,int black,int num)
 {
     ENCHUFF *colorhuff[]= {whitehuff,blackhuff};
-    int ret=0;
+    unsigned int code;
 
     while (num>=2560)
     {
-        ret=writecode(state,colorhuff[black],63+2560/64);
+        const int ret=writecode(state,colorhuff[black],63+2560/64);
         if (ret)
         {
             return ret;
         }
         num-=2560;
     }
-    if (num>=64)
+    code=runcodetable[black][num];
+    return putbits(state,code>>5,code&0x1f);
+}
+
+// top up the bit reservoir from the input buffer, reading the next block when it is used up;
+// the legacy byte reader (init_g4_read) is only asked for bytes while fewer than >bits bits are
+// buffered, so it never reads further into its input than the code being decoded needs
+// returns 0, or the (<=0) result of >read when no more input is available
+int fillbits(G4STATE *state,int bits)
+{
+    while (state->bitpos<=56)
     {
-        ret=writecode(state,colorhuff[black],63+num/64);
-        if (ret)
+        if (state->bufpos>=state->buflen)
         {
-            return ret;
+            int ret;
+            if (state->read_old)
+            {
+                if (state->bitpos>=bits)
+                {
+                    return 0;
+                }
+                ret=((*state->read_old)(state->user_read,state->buf,1))?0:1;
+            }
+            else if (!state->read)   // memory source: all there is
+            {
+                return 0;
+            }
+            else
+            {
+                ret=(*state->read)(state->user_read,state->buf,state->bufsize);
+            }
+            if (ret<=0)   // end of input or read error
+            {
+                return ret;
+            }
+            state->bufstart+=state->buflen;
+            state->buflen=ret;
+            state->bufpos=0;
+        }
+        if ( (state->bitpos<=32)&&(state->bufpos+4<=state->buflen) )
+        {
+            const unsigned char *in=state->buf+state->bufpos;
+            state->bitbuf|=(uint64_t)(((uint32_t)in[0]<<24)|(in[1]<<16)|(in[2]<<8)|in[3])<<(32-state->bitpos);
+            state->bitpos+=32;
+            state->bufpos+=4;
+        }
+        else
+        {
+            state->bitbuf|=(uint64_t)state->buf[state->bufpos++]<<(56-state->bitpos);
+            state->bitpos+=8;
         }
-        num%=64;
     }
-    return writecode(state,colorhuff[black],num);
+    return 0;
 }
 
-int next_bits(G4STATE *state,int bits)
+static inline int next_bits(G4STATE *state,int bits)
 {
-    int ret,iA;
-    unsigned char buf[4];
-
     if (state->bitpos<bits)   // ensure enough bits
     {
-        int num=(bits-state->bitpos+7)>>3;
-        ret=(*state->read)(state->user_read,buf,num);
-        if (ret)
+        fillbits(state,bits);
+        if (state->bitpos<bits)
         {
             return -MAX_OP;
         }
-        for (iA=0; iA<num; iA++)
-        {
-            state->bitbuf|=buf[iA]<<(24-state->bitpos);
-            state->bitpos+=8;
-        }
     }
-    return state->bitbuf>>(32-bits);
+    return state->bitbuf>>(64-bits);
 }
 
-void eat_bits(G4STATE *state,int bits)
+static inline void eat_bits(G4STATE *state,int bits)
 {
     state->bitpos-=bits;
     state->bitbuf<<=bits;
 }
 
+// reads the EOL in front of a G3 line, skipping FILL (extra 0 bits) before it
+static inline int read_eol(G4STATE *state)
+{
+    int code;
+
+    while ((code=next_bits(state,12))==0)
+    {
+        // keep the last 11 zeros
+        const int zeros=(state->bitbuf)?clz64(state->bitbuf):64;
+        eat_bits(state,((zeros<state->bitpos)?zeros:state->bitpos)-11);
+    }
+    if (code!=0x001)
+    {
+        return -ERR_WRONG_CODE;
+    }
+    eat_bits(state,12);
+    return 0;
+}
+
 int readcode(G4STATE *state,unsigned short *table,int bits)
 {
     int ip=0,data,len=0;
@@ -210,14 +586,133 @@ int readcode(G4STATE *state,unsigned short *table,int bits)
     }
 }
 
+#if G4_WIDE_TABLES
+// Single-lookup decoding tables: indexed by the next DECODE_WIDE_*_BITS bits,
+// entries like in tables.h: (len<<12)|run resp. (len<<12)|(0xfff&OP_?), 0 for unknown codes
+#define DECODE_WIDE_WHITE_BITS 12
+#define DECODE_WIDE_BLACK_BITS 13
+#define DECODE_WIDE_OPCODE_BITS 12
+static unsigned short widewhitetable[1<<DECODE_WIDE_WHITE_BITS];
+static unsigned short wideblacktable[1<<DECODE_WIDE_BLACK_BITS];
+static unsigned short wideopcodetable[1<<DECODE_WIDE_OPCODE_BITS];
+
+// Multi-symbol table for runs of V0 (1), VR1 (011), VL1 (010) codes:
+// indexed by the next DECODE_VMODE_BITS bits; (num) | (len<<2|(dv+1))<<(4+4*i) for up to 7 codes,
+// 0 if the window does not start with one of them
+#define DECODE_VMODE_BITS 8
+static unsigned int vmodetable[1<<DECODE_VMODE_BITS];
+
+static void fill_wide_table(unsigned short *table,int bits,const ENCHUFF *code,int value)
+{
+    const int start=code->bits>>(16-bits),num=1<<(bits-code->len);
+    int iA;
+
+    for (iA=0; iA<num; iA++)
+    {
+        table[start+iA]=(code->len<<12)|(value&0xfff);
+    }
+}
+
+// called once, by init_tables
+static void init_wide_tables(void)
+{
+    const ENCHUFF fill= {12,0x0000};
+    int iA;
+
+    for (iA=0; iA<104; iA++)
+    {
+        const int run=(iA<64)?iA:(iA-63)*64;
+        fill_wide_table(widewhitetable,DECODE_WIDE_WHITE_BITS,&whitehuff[iA],run);
+        fill_wide_table(wideblacktable,DECODE_WIDE_BLACK_BITS,&blackhuff[iA],run);
+    }
+    fill_wide_table(widewhitetable,DECODE_WIDE_WHITE_BITS,&opcode[-EOL],EOL);
+    fill_wide_table(wideblacktable,DECODE_WIDE_BLACK_BITS,&opcode[-EOL],EOL);
+    fill_wide_table(widewhitetable,DECODE_WIDE_WHITE_BITS,&fill,FILL);
+    fill_wide_table(wideblacktable,DECODE_WIDE_BLACK_BITS,&fill,FILL);
+    for (iA=-EOL; iA<MAX_OP; iA++)
+    {
+        if ( (iA!=-FILL)&&(opcode[iA].len>0) )
+        {
+            fill_wide_table(wideopcodetable,DECODE_WIDE_OPCODE_BITS,&opcode[iA],-iA);
+        }
+    }
+    for (iA=0; iA<(1<<DECODE_VMODE_BITS); iA++)
+    {
+        unsigned int entry=0;
+        int pos=0,num=0;
+
+        while ( (pos<DECODE_VMODE_BITS)&&(num<7) )
+        {
+            const int rest=(iA<<pos)&((1<<DECODE_VMODE_BITS)-1);
+            if (rest>>(DECODE_VMODE_BITS-1))   // 1: V0
+            {
+                entry|=(1<<2|1)<<(4+4*num);
+                pos+=1;
+            }
+            else if ( (pos+3<=DECODE_VMODE_BITS)&&((rest>>(DECODE_VMODE_BITS-3))==3) )     // 011: VR1
+            {
+                entry|=(3<<2|2)<<(4+4*num);
+                pos+=3;
+            }
+            else if ( (pos+3<=DECODE_VMODE_BITS)&&((rest>>(DECODE_VMODE_BITS-3))==2) )     // 010: VL1
+            {
+                entry|=(3<<2|0)<<(4+4*num);
+                pos+=3;
+            }
+            else
+            {
+                break;
+            }
+            num++;
+        }
+        vmodetable[iA]=(num)?(entry|num):0;
+    }
+}
+
+// like readcode, but with a single lookup; >narrow,>narrowbits: the readcode table, used
+// when the reservoir runs low on the legacy byte reader, which must not read ahead >bits
+static inline int readwide(G4STATE *state,const unsigned short *table,int bits,unsigned short *narrow,int narrowbits)
+{
+    int ip;
+
+    if (state->bitpos<bits)   // near the end of input: missing bits read as 0
+    {
+        if (state->read_old)
+        {
+            return readcode(state,narrow,narrowbits);
+        }
+        fillbits(state,bits);
+    }
+    ip=table[state->bitbuf>>(64-bits)];
+    if ( (!ip)||((ip>>12)>state->bitpos) )
+    {
+        return (state->bitpos<bits)?-MAX_OP:-1;
+    }
+    eat_bits(state,ip>>12);
+    if ((ip&0xfff)>2560)   // OPCODE
+    {
+        return ip|0xfffff000;
+    }
+    return ip&0xfff;
+}
+#endif
+
 int readhuff(G4STATE *state,int black)
 {
+#if G4_WIDE_TABLES
+    static const unsigned short *widetable[]= {widewhitetable,wideblacktable};
+    static const int widebits[]= {DECODE_WIDE_WHITE_BITS,DECODE_WIDE_BLACK_BITS};
+#endif
     unsigned short *colortable[]= {whitehufftable,blackhufftable};
     int ret,val=0;
 
     while (1)
     {
+#if G4_WIDE_TABLES
+        ret=readwide(state,widetable[black],widebits[black],colortable[black],DECODE_COLORHUFF_BITS);
+#else
         ret=readcode(state,colortable[black],DECODE_COLORHUFF_BITS);
+#endif
         if (ret<0)   // maybe: -1,-2,-3; read error: -MAX_OP
         {
             return ret;
@@ -235,106 +730,105 @@ int readhuff(G4STATE *state,int black)
     return val;
 }
 
-void rle_encode(int *line,const unsigned char *inbuf,int width)
+G4_INLINE void rle_encode(int *line,const unsigned char *inbuf,const int width)
 {
-    unsigned int ip;
-    int pos;
+    const int bwidth=(width+7)/8;
+    uint64_t fill=0,diff; // diff: bits that differ from the current color
+    int boff=0; // byte offset of the current word
 
-    if (*inbuf&0x80)
-    {
-        *line++=0;
-        ip=rlecode[*inbuf^0xff];
-    }
-    else
-    {
-        ip=rlecode[*inbuf];
-    }
-    pos=ip&0xf;
-    while (pos<width)
+    diff=(bwidth>=8)?load_be64(inbuf):load_be64_part(inbuf,bwidth);
+    while (1)
     {
-        ip>>=4;
-        if (ip==0)
+        if (diff)
         {
-            if (*inbuf&1)
-            {
-                ++inbuf;
-                if ((*inbuf&0x80)==0)
-                {
-                    *line++=pos;
-                    ip=rlecode[*inbuf];
-                }
-                else
-                {
-                    ip=rlecode[*inbuf^0xff];
-                }
-            }
-            else
+            const int bit=clz64(diff),pos=boff*8+bit;
+            if (pos>=width)
             {
-                ++inbuf;
-                if (*inbuf&0x80)
-                {
-                    *line++=pos;
-                    ip=rlecode[*inbuf^0xff];
-                }
-                else
-                {
-                    ip=rlecode[*inbuf];
-                }
+                break;
             }
+            *line++=pos;
+            fill=~fill;
+            diff=~diff&(~(uint64_t)0>>bit);
         }
         else
         {
-            *line++=pos;
+            boff+=8;
+            if (boff>=bwidth)
+            {
+                break;
+            }
+            diff=( (bwidth-boff>=8)?load_be64(inbuf+boff):load_be64_part(inbuf+boff,bwidth-boff) )^fill;
+            if ( (!diff)&&(bwidth-boff>8) )   // long stretch of the current color
+            {
+                boff+=8+(*skip_fill)(inbuf+boff+8,bwidth-boff-8,(unsigned char)fill);
+                if (boff>=bwidth)
+                {
+                    break;
+                }
+                diff=( (bwidth-boff>=8)?load_be64(inbuf+boff):load_be64_part(inbuf+boff,bwidth-boff) )^fill;
+            }
         }
-        pos+=ip&0xf;
     }
     *line++=width;
 }
 
-void rle_decode(const int *line,unsigned char *outbuf,int width)
+// every byte of >outbuf is written exactly once: whole words with one store, long runs with memset
+G4_INLINE void rle_decode(const int *line,unsigned char *outbuf,const int width)
 {
-    static const unsigned char rletab[8]= {0x00,0x80,0xc0,0xe0,0xf0,0xf8,0xfc,0xfe};
-    int pos=0,black=0;
+    const int bwidth=(width+7)/8;
+    uint64_t word=0; // pixels of the current word
+    int wpos=0,pos=0,black=0; // wpos: byte offset of the current word
 
-    memset(outbuf,0,(width+7)/8);
-    for (; *line<=width; line++)
+    for (; *line<=width; line++,black^=1)
     {
-        while (*line>pos)
+        const int end=*line;
+        if (end<=pos)
         {
-            const int bitpos=pos&7;
-            if (*line-pos>=8-bitpos)
+            continue;
+        }
+        if (end-wpos*8<64)   // run ends in the current word
+        {
+            if (black)
             {
-                if (black)
-                {
-                    *outbuf|=0xff>>bitpos;
-                }
-                outbuf++;
-                pos+=8-bitpos;
+                word|=(~(uint64_t)0>>(pos-wpos*8))&~(~(uint64_t)0>>(end-wpos*8));
             }
-            else
+        }
+        else
+        {
+            int num;
+            if (black)
             {
-                if (black)
-                {
-                    *outbuf|=rletab[*line-pos]>>bitpos;
-                }
-                pos=*line;
+                word|=~(uint64_t)0>>(pos-wpos*8);
+            }
+            store_be64(outbuf+wpos,word);
+            wpos+=8;
+            num=((end-wpos*8)>>6)*8; // whole words inside the run
+            if (num)
+            {
+                memset(outbuf+wpos,(black)?0xff:0x00,num);
+                wpos+=num;
             }
+            word=( (black)&&(end>wpos*8) )?~(~(uint64_t)0>>(end-wpos*8)):0;
         }
-        black^=1;
+        pos=end;
+    }
+    for (; wpos<bwidth; wpos++,word<<=8)
+    {
+        outbuf[wpos]=word>>56;
     }
 }
 
-int encode_line_2d(G4STATE *state)
+G4_INLINE int encode_line_2d(G4STATE *state,const int width)
 {
     int black=0,a0,*curpos,*lastpos,ret;
 
     a0=0;
     curpos=state->curline; // a1
     lastpos=state->lastline; // b1
-    while (*curpos<=state->width)
+    while (*curpos<=width)
     {
         int iA=*lastpos-*curpos;
-        if ( (*lastpos<state->width)&&(lastpos[1]<*curpos) )   // b2<a1
+        if ( (*lastpos<width)&&(lastpos[1]<*curpos) )   // b2<a1
         {
             if ((ret=writecode(state,opcode,-OP_P)))
             {
@@ -349,7 +843,7 @@ int encode_line_2d(G4STATE *state)
                 return ret;
             }
             a0=*curpos;
-            if (a0>=state->width)
+            if (a0>=width)
             {
                 break;
             }
@@ -359,7 +853,7 @@ int encode_line_2d(G4STATE *state)
             {
                 lastpos--;
             }
-            else if (*lastpos<state->width)
+            else if (*lastpos<width)
             {
                 lastpos++;
             }
@@ -375,7 +869,7 @@ int encode_line_2d(G4STATE *state)
                 return ret;
             }
             a0=*curpos;
-            if (a0<state->width)   // otherwise "generate a 0"
+            if (a0<width)   // otherwise "generate a 0"
             {
                 curpos++;
             }
@@ -384,16 +878,16 @@ int encode_line_2d(G4STATE *state)
                 return ret;
             }
             a0=*curpos;
-            if (a0>=state->width)
+            if (a0>=width)
             {
                 break;
             }
             curpos++;
         }
-        while ( (*lastpos<state->width)&&(*lastpos<=a0) )   // update lastpos
+        while ( (*lastpos<width)&&(*lastpos<=a0) )   // update lastpos
         {
             lastpos++;
-            if (*lastpos<state->width)
+            if (*lastpos<width)
             {
                 lastpos++;
             }
@@ -402,7 +896,7 @@ int encode_line_2d(G4STATE *state)
     return 0;
 }
 
-int encode_line_1d(G4STATE *state)
+G4_INLINE int encode_line_1d(G4STATE *state,const int width)
 {
     int black=0,a0,*curpos,ret;
 
@@ -418,11 +912,11 @@ int encode_line_1d(G4STATE *state)
         a0=*curpos;
         curpos++;
     }
-    while (a0<state->width);
+    while (a0<width);
     return 0;
 }
 
-int decode_line_2d(G4STATE *state)
+G4_INLINE int decode_line_2d(G4STATE *state,const int width)
 {
     int black=0,a0,*curpos,*lastpos,ret;
 
@@ -431,7 +925,54 @@ int decode_line_2d(G4STATE *state)
     lastpos=state->lastline; // b1
     do
     {
+#if G4_WIDE_TABLES
+        // fast path: apply the V0/VR1/VL1 codes of a whole window in one go
+        if ( (state->bitpos<DECODE_VMODE_BITS)&&(!state->read_old) )
+        {
+            fillbits(state,DECODE_VMODE_BITS);
+        }
+        if (state->bitpos>=DECODE_VMODE_BITS)
+        {
+            unsigned int vm=vmodetable[state->bitbuf>>(64-DECODE_VMODE_BITS)];
+            if (vm)
+            {
+                int num=vm&0xf;
+                do
+                {
+                    vm>>=4;
+                    a0=*lastpos+(int)(vm&3)-1;
+                    if (a0>width)   // corrupt data
+                    {
+                        return -ERR_WRONG_CODE;
+                    }
+                    eat_bits(state,(vm>>2)&3);
+                    *curpos++=a0;
+                    black^=1;
+                    if ( (lastpos>state->lastline)&&(lastpos[-1]>a0) )   // maybe previous is still interesting!
+                    {
+                        lastpos--;
+                    }
+                    else if (*lastpos<width)
+                    {
+                        lastpos++;
+                    }
+                    while ( (*lastpos<width)&&(*lastpos<=a0) )   // update lastpos
+                    {
+                        lastpos++;
+                        if (*lastpos<width)
+                        {
+                            lastpos++;
+                        }
+                    }
+                }
+                while ( (--num>0)&&(a0<width) );
+                continue;
+            }
+        }
+        ret=readwide(state,wideopcodetable,DECODE_WIDE_OPCODE_BITS,opcodetable,DECODE_OPCODE_BITS);
+#else
         ret=readcode(state,opcodetable,DECODE_OPCODE_BITS);
+#endif
         if (ret==-1)
         {
             return -ERR_UNKNOWN_CODE;
@@ -443,6 +984,10 @@ int decode_line_2d(G4STATE *state)
         else if (ret==OP_P)
         {
             a0=lastpos[1];
+            if (a0>=width)   // corrupt data: b2<a1<=width, the line would end without its last element
+            {
+                return -ERR_WRONG_CODE;
+            }
         }
         else if (ret==OP_H)
         {
@@ -483,14 +1028,17 @@ int decode_line_2d(G4STATE *state)
         else if ( (ret>=OP_VL3)&&(ret<=OP_VR3) )     // OP_V..
         {
             a0=*lastpos+(ret-OP_V);
-            assert(a0<=state->width);
+            if (a0>width)   // corrupt data
+            {
+                return -ERR_WRONG_CODE;
+            }
             *curpos++=a0;
             black^=1;
             if ( (lastpos>state->lastline)&&(lastpos[-1]>a0) )   // maybe previous is still interesting!
             {
                 lastpos--;
             }
-            else if (*lastpos<state->width)
+            else if (*lastpos<width)
             {
                 lastpos++;
             }
@@ -508,32 +1056,33 @@ int decode_line_2d(G4STATE *state)
             }
             else     // G3 2d, TODO? hmm eol in 2d code...
             {
-                assert(0);
                 return -ERR_WRONG_CODE;
             }
         }
-        else     // OP_EXT
+        else     // OP_EXT (not supported) or corrupt data
         {
-            assert(0);
             return -ERR_UNKNOWN_CODE;
         }
-        while ( (*lastpos<state->width)&&(*lastpos<=a0) )   // update lastpos
+        while ( (*lastpos<width)&&(*lastpos<=a0) )   // update lastpos
         {
             lastpos++;
-            if (*lastpos<state->width)
+            if (*lastpos<width)
             {
                 lastpos++;
             }
         }
     }
-    while (a0<state->width);
+    while (a0<width);
 //  printf("%d\n",a0);
-    assert(a0==state->width);
-    *curpos++=state->width+1;
+    if (a0!=width)   // corrupt data: beyond the end of the line
+    {
+        return -ERR_WRONG_CODE;
+    }
+    *curpos++=width+1;
     return 0;
 }
 
-int decode_line_1d(G4STATE *state)
+G4_INLINE int decode_line_1d(G4STATE *state,const int width)
 {
     int black=0,a0,*curpos,ret;
 
@@ -562,14 +1111,16 @@ int decode_line_1d(G4STATE *state)
                 }
                 return 1;
             }
-            // a0<state->width! TODO? not enough, maybe graceful!
-//      *curpos++=state->width;
-            assert(0);
+            // a0<width! TODO? not enough, maybe graceful!
+//      *curpos++=width;
             return -ERR_WRONG_CODE;
         }
         else if (ret==FILL)
         {
-            // TODO? handle FILL
+            if (curpos==state->curline)   // FILL in front of the next EOL: EOL EOL ...
+            {
+                return 1;
+            }
             return -ERR_UNKNOWN_CODE;
         }
         else if (ret==-MAX_OP)
@@ -588,12 +1139,60 @@ int decode_line_1d(G4STATE *state)
         *curpos++=a0;
         black^=1;
     }
-    while (a0<state->width);
-    assert(a0==state->width);
-    *curpos++=state->width+1;
+    while (a0<width);
+    if (a0!=width)   // corrupt data: last run too long
+    {
+        return -ERR_WRONG_CODE;
+    }
+    *curpos++=width+1;
+    return 0;
+}
+
+// sets up >state->curline for the row >inbuf.
+// returns the number of changing elements (incl. >width) when the row equals the previous one
+// (then curline is a copy of lastline), otherwise 0
+G4_INLINE int prepare_line(G4STATE *state,const unsigned char *inbuf,const int width)
+{
+    const int bwidth=(width+7)/8;
+    const unsigned char lastmask=0xff<<((8-(width&7))&7);
+    int num;
+
+    if ( (state->lastrow_ok)&&(memcmp(inbuf,state->lastrow,bwidth-1)==0)&&(((inbuf[bwidth-1]^state->lastrow[bwidth-1])&lastmask)==0) )
+    {
+        for (num=0; state->lastline[num]<width; num++) ;
+        num++;
+        memcpy(state->curline,state->lastline,num*sizeof(int));
+        return num;
+    }
+    if ( ((*skip_fill)(inbuf,bwidth-1,0x00)==(size_t)(bwidth-1))&&(!(inbuf[bwidth-1]&lastmask)) )   // blank
+    {
+        state->curline[0]=width;
+    }
+    else
+    {
+        rle_encode(state->curline,inbuf,width);
+    }
+    memcpy(state->lastrow,inbuf,bwidth);
+    state->lastrow_ok=1;
     return 0;
 }
 
+// a line equal to its reference line codes as V0 for each of its >num changing elements
+int encode_line_same(G4STATE *state,int num)
+{
+    int ret;
+
+    assert( (opcode[-OP_V].len==1)&&(opcode[-OP_V].bits==0x8000) );
+    for (; num>32; num-=32)
+    {
+        if ((ret=putbits(state,0xffffffff,32)))
+        {
+            return ret;
+        }
+    }
+    return putbits(state,0xffffffff>>(32-num),num);
+}
+
 void swap_lines(G4STATE *state)
 {
     // swap lastline, curline
@@ -604,13 +1203,87 @@ void swap_lines(G4STATE *state)
     state->lines_done++;
 }
 
+// codes >state->curline; >same: see prepare_line
+int encode_line(G4STATE *state,int same)
+{
+    int ret;
+
+    if (state->kval==-1)   // G4
+    {
+        ret=(same)?encode_line_same(state,same):encode_line_2d(state,state->width);
+    }
+    else if (state->kval==0)     // G3 1d
+    {
+        if ((ret=writecode(state,opcode,-EOL)))
+        {
+            return -ERR_WRITE;
+        }
+        ret=encode_line_1d(state,state->width);
+    }
+    else
+    {
+        if (state->lines_done%state->kval!=0)
+        {
+            if ((ret=writecode(state,opcode,-EOL0)))
+            {
+                return -ERR_WRITE;
+            }
+            ret=(same)?encode_line_same(state,same):encode_line_2d(state,state->width);
+        }
+        else
+        {
+            if ((ret=writecode(state,opcode,-EOL1)))
+            {
+                return -ERR_WRITE;
+            }
+            ret=encode_line_1d(state,state->width);
+        }
+    }
+
+    swap_lines(state);
+    return ret;
+}
+
+// reads EOL and the line into >state->curline; returns 0, 1 on End-Of-File, <0 on Error
+int decode_line(G4STATE *state)
+{
+    int ret=0;
+
+    if ( (state->kval>=0)&&((ret=read_eol(state))) )   // read EOL on G3
+    {
+        return ret;
+    }
+    if (state->kval==-1)   // G4
+    {
+        ret=decode_line_2d(state,state->width);
+    }
+    else if (state->kval==0)     // G3 1d
+    {
+        ret=decode_line_1d(state,state->width);
+    }
+    else
+    {
+        if (next_bits(state,1))
+        {
+            eat_bits(state,1);
+            ret=decode_line_1d(state,state->width);
+        }
+        else
+        {
+            eat_bits(state,1);
+            ret=decode_line_2d(state,state->width);
+        }
+    }
+    return ret;
+}
+
 // main procedures
 int encode_g4(G4STATE *state,const unsigned char *inbuf)
 {
-    int ret=0,iA;
+    int ret=0,iA,same;
 
     assert(state);
-    if ( (!state)||(!state->write) )
+    if ( (!state)||(!state->encoding) )
     {
         return -ERR_INVALID_ARGUMENT;
     }
@@ -648,97 +1321,1421 @@ int encode_g4(G4STATE *state,const unsigned char *inbuf)
             }
         }
         // "pad to byte boundary" and flush
-        writeflush(state);
+        if (writeflush(state))
+        {
+            return -ERR_WRITE;
+        }
         return 0;
     }
-    rle_encode(state->curline,inbuf,state->width);
+    same=prepare_line(state,inbuf,state->width);
+    return encode_line(state,same);
+}
 
-    if (state->kval==-1)   // G4
+int encode_g4_runs(G4STATE *state,const int *runs)
+{
+    int num;
+
+    assert(state);
+    assert(runs);
+    if ( (!state)||(!state->encoding)||(!runs) )
     {
-        ret=encode_line_2d(state);
+        return -ERR_INVALID_ARGUMENT;
     }
-    else if (state->kval==0)     // G3 1d
+    // strictly increasing up to >width (only the first one may be 0)
+    if ( (runs[0]<0)||(runs[0]>state->width) )
     {
-        if ((ret=writecode(state,opcode,-EOL)))
-        {
-            return -ERR_WRITE;
-        }
-        ret=encode_line_1d(state);
+        return -ERR_INVALID_ARGUMENT;
     }
-    else
+    for (num=1; runs[num-1]<state->width; num++)
     {
-        if (state->lines_done%state->kval!=0)
+        if ( (runs[num]<=runs[num-1])||(runs[num]>state->width) )
         {
-            if ((ret=writecode(state,opcode,-EOL0)))
-            {
-                return -ERR_WRITE;
-            }
-            ret=encode_line_2d(state);
-        }
-        else
-        {
-            if ((ret=writecode(state,opcode,-EOL1)))
-            {
-                return -ERR_WRITE;
-            }
-            ret=encode_line_1d(state);
+            return -ERR_INVALID_ARGUMENT;
         }
     }
-
-    swap_lines(state);
-    return ret;
+    memcpy(state->curline,runs,num*sizeof(int));
+    state->lastrow_ok=0;
+    return encode_line(state,(memcmp(runs,state->lastline,num*sizeof(int))==0)?num:0);
 }
 
 int decode_g4(G4STATE *state,unsigned char *outbuf)
 {
-    int ret=0;
+    int ret;
 
     assert(state);
     assert(outbuf);
-    if ( (!state)||(!state->read)||(!outbuf) )
+    if ( (!state)||(state->encoding)||(!outbuf) )
     {
         return -ERR_INVALID_ARGUMENT;
     }
-    if (state->kval>=0)
+    if ((ret=decode_line(state)))   // error, or File done
     {
-        // read EOL on G3
-        if (next_bits(state,12)!=0x001)
-        {
-            return -ERR_WRONG_CODE;
-        }
-        eat_bits(state,12);
+        return ret;
     }
-    if (state->kval==-1)   // G4
+    rle_decode(state->curline,outbuf,state->width);
+
+    swap_lines(state);
+    return 0;
+}
+
+int decode_g4_runs(G4STATE *state,int *runs)
+{
+    int ret,num;
+
+    assert(state);
+    assert(runs);
+    if ( (!state)||(state->encoding)||(!runs) )
     {
-        ret=decode_line_2d(state);
+        return -ERR_INVALID_ARGUMENT;
     }
-    else if (state->kval==0)     // G3 1d
+    if ((ret=decode_line(state)))   // error, or File done
     {
-        ret=decode_line_1d(state);
+        return ret;
     }
-    else
+    for (num=0; state->curline[num]<state->width; num++) ;
+    memcpy(runs,state->curline,(num+1)*sizeof(int));
+
+    swap_lines(state);
+    return 0;
+}
+
+// adds the black pixels >start .. >end-1 to their blocks of 1<<shift columns
+G4_INLINE void add_black(int *sums,int start,int end,int width,const int shift)
+{
+    int iA,last;
+
+    if (end>width)   // the run stops at the edge of the image
     {
-        if (next_bits(state,1))
-        {
-            eat_bits(state,1);
-            ret=decode_line_1d(state);
-        }
-        else
-        {
-            eat_bits(state,1);
-            ret=decode_line_2d(state);
-        }
+        end=width;
+    }
+    iA=start>>shift;
+    last=end>>shift;
+
+    if (iA==last)
+    {
+        sums[iA]+=end-start;
+        return;
+    }
+    sums[iA]+=((iA+1)<<shift)-start;
+    for (iA++; iA<last; iA++)
+    {
+        sums[iA]+=1<<shift;
+    }
+    if (end&((1<<shift)-1))
+    {
+        sums[last]+=end&((1<<shift)-1);
+    }
+}
+
+int decode_g4_sums(G4STATE *state,int *sums,int shift)
+{
+    const int *line;
+    int ret,iA;
+
+    assert(state);
+    assert(sums);
+    if ( (!state)||(state->encoding)||(!sums)||(shift<0)||(shift>15) )
+    {
+        return -ERR_INVALID_ARGUMENT;
     }
-    if (ret<0)   // error
+    if ((ret=decode_line(state)))   // error, or File done
     {
         return ret;
     }
-    else if (ret==1)     // File done
+    // black runs go from an even to the next odd changing element
+    line=state->curline;
+    for (iA=0; line[iA]<state->width; iA+=2)
     {
-        return 1;
+        add_black(sums,line[iA],line[iA+1],state->width,shift);
     }
-    rle_decode(state->curline,outbuf,state->width);
 
     swap_lines(state);
     return 0;
 }
+
+int transcode_g4(G4STATE *in,G4STATE *out)
+{
+    int ret,lines=0;
+
+    assert( (in)&&(out) );
+    if ( (!in)||(!out)||(in->encoding)||(!out->encoding)||(in->width!=out->width) )
+    {
+        return -ERR_INVALID_ARGUMENT;
+    }
+    while ((ret=decode_line(in))==0)
+    {
+        if ((ret=encode_g4_runs(out,in->curline)))
+        {
+            return (ret<0)?ret:-ERR_WRITE;
+        }
+        swap_lines(in);
+        lines++;
+    }
+    if (ret<0)
+    {
+        return ret;
+    }
+    if ((ret=encode_g4(out,NULL)))
+    {
+        return ret;
+    }
+    return lines;
+}
+
+// per-row loops of encode_g4_image/decode_g4_image, one for each code
+G4_INLINE int encode_rows_g4_w(G4STATE *state,const unsigned char *inbuf,int height,int stride,const int width)
+{
+    int ret=0,iA,same;
+
+    for (iA=0; (iA<height)&&(!ret); iA++,inbuf+=stride)
+    {
+        same=prepare_line(state,inbuf,width);
+        ret=(same)?encode_line_same(state,same):encode_line_2d(state,width);
+        swap_lines(state);
+    }
+    return (ret)?-ERR_WRITE:0;
+}
+
+G4_INLINE int encode_rows_1d_w(G4STATE *state,const unsigned char *inbuf,int height,int stride,const int width)
+{
+    int ret=0,iA;
+
+    for (iA=0; (iA<height)&&(!ret); iA++,inbuf+=stride)
+    {
+        if ((ret=writecode(state,opcode,-EOL)))
+        {
+            break;
+        }
+        prepare_line(state,inbuf,width);
+        ret=encode_line_1d(state,width);
+        swap_lines(state);
+    }
+    return (ret)?-ERR_WRITE:0;
+}
+
+G4_INLINE int encode_rows_2d_w(G4STATE *state,const unsigned char *inbuf,int height,int stride,const int width)
+{
+    int ret=0,iA,same;
+
+    for (iA=0; (iA<height)&&(!ret); iA++,inbuf+=stride)
+    {
+        same=prepare_line(state,inbuf,width);
+        if (state->lines_done%state->kval!=0)
+        {
+            if ((ret=writecode(state,opcode,-EOL0)))
+            {
+                break;
+            }
+            ret=(same)?encode_line_same(state,same):encode_line_2d(state,width);
+        }
+        else
+        {
+            if ((ret=writecode(state,opcode,-EOL1)))
+            {
+                break;
+            }
+            ret=encode_line_1d(state,width);
+        }
+        swap_lines(state);
+    }
+    return (ret)?-ERR_WRITE:0;
+}
+
+// these return the number of rows decoded, <0 on Error
+G4_INLINE int decode_rows_g4_w(G4STATE *state,unsigned char *outbuf,int height,int stride,const int width)
+{
+    int ret=0,iA;
+
+    for (iA=0; iA<height; iA++,outbuf+=stride)
+    {
+        if ((ret=decode_line_2d(state,width)))
+        {
+            break;
+        }
+        rle_decode(state->curline,outbuf,width);
+        swap_lines(state);
+    }
+    return (ret<0)?ret:iA;
+}
+
+G4_INLINE int decode_rows_1d_w(G4STATE *state,unsigned char *outbuf,int height,int stride,const int width)
+{
+    int ret=0,iA;
+
+    for (iA=0; iA<height; iA++,outbuf+=stride)
+    {
+        if ((ret=read_eol(state)))
+        {
+            return ret;
+        }
+        if ((ret=decode_line_1d(state,width)))
+        {
+            break;
+        }
+        rle_decode(state->curline,outbuf,width);
+        swap_lines(state);
+    }
+    return (ret<0)?ret:iA;
+}
+
+G4_INLINE int decode_rows_2d_w(G4STATE *state,unsigned char *outbuf,int height,int stride,const int width)
+{
+    int ret=0,iA;
+
+    for (iA=0; iA<height; iA++,outbuf+=stride)
+    {
+        if ((ret=read_eol(state)))
+        {
+            return ret;
+        }
+        ret=next_bits(state,1);
+        eat_bits(state,1);
+        if ((ret=(ret)?decode_line_1d(state,width):decode_line_2d(state,width)))
+        {
+            break;
+        }
+        rle_decode(state->curline,outbuf,width);
+        swap_lines(state);
+    }
+    return (ret<0)?ret:iA;
+}
+
+// the row loops with the width as a constant for the standard fax width (A4 at 8 pels/mm),
+// so the compiler can fold the width tests; any other width takes the generic copy
+#define G4_FAX_WIDTH 1728
+#define G4_ROWS(name,buftype) \
+    static int name(G4STATE *state,buftype buf,int height,int stride) \
+    { \
+        if (state->width==G4_FAX_WIDTH) \
+        { \
+            return name##_w(state,buf,height,stride,G4_FAX_WIDTH); \
+        } \
+        return name##_w(state,buf,height,stride,state->width); \
+    }
+G4_ROWS(encode_rows_g4,const unsigned char *)
+G4_ROWS(encode_rows_1d,const unsigned char *)
+G4_ROWS(encode_rows_2d,const unsigned char *)
+G4_ROWS(decode_rows_g4,unsigned char *)
+G4_ROWS(decode_rows_1d,unsigned char *)
+G4_ROWS(decode_rows_2d,unsigned char *)
+#undef G4_ROWS
+
+int encode_g4_image(G4STATE *state,const unsigned char *inbuf,int height,int stride)
+{
+
+    assert(state);
+    if ( (!state)||(!state->encoding)||( (!inbuf)&&(height>0) ) )
+    {
+        return -ERR_INVALID_ARGUMENT;
+    }
+    if (state->kval==-1)   // G4
+    {
+        return encode_rows_g4(state,inbuf,height,stride);
+    }
+    else if (state->kval==0)     // G3 1d
+    {
+        return encode_rows_1d(state,inbuf,height,stride);
+    }
+    return encode_rows_2d(state,inbuf,height,stride);
+}
+
+int decode_g4_image(G4STATE *state,unsigned char *outbuf,int height,int stride)
+{
+    assert(state);
+    if ( (!state)||(state->encoding)||( (!outbuf)&&(height>0) ) )
+    {
+        return -ERR_INVALID_ARGUMENT;
+    }
+    if (state->kval==-1)   // G4
+    {
+        return decode_rows_g4(state,outbuf,height,stride);
+    }
+    else if (state->kval==0)     // G3 1d
+    {
+        return decode_rows_1d(state,outbuf,height,stride);
+    }
+    return decode_rows_2d(state,outbuf,height,stride);
+}
+
+int skip_g4(G4STATE *state,int lines)
+{
+    int ret,iA;
+
+    assert(state);
+    if ( (!state)||(state->encoding) )
+    {
+        return -ERR_INVALID_ARGUMENT;
+    }
+    for (iA=0; iA<lines; iA++)
+    {
+        if ((ret=decode_line(state)))   // error, or File done
+        {
+            return (ret<0)?ret:iA;
+        }
+        swap_lines(state);
+    }
+    return lines;
+}
+
+// changing elements of >line in the columns >x .. >x+>w-1, shifted to start at 0
+G4_INLINE void clip_line(const int *line,int *out,int x,int w)
+{
+    int black=0;
+
+    // the color at >x: the number of changes up to there
+    for (; *line<=x; line++)
+    {
+        black^=1;
+    }
+    if (black)
+    {
+        *out++=0;
+    }
+    for (; *line<x+w; line++)
+    {
+        *out++=*line-x;
+    }
+    out[0]=w;
+    out[1]=w+1;
+}
+
+int decode_g4_region(G4STATE *state,unsigned char *outbuf,int height,int stride,int x,int w)
+{
+    int ret=0,iA;
+
+    assert(state);
+    if ( (!state)||(state->encoding)||( (!outbuf)&&(height>0) )||(x<0)||(w<=0)||(x+w>state->width) )
+    {
+        return -ERR_INVALID_ARGUMENT;
+    }
+    for (iA=0; iA<height; iA++,outbuf+=stride)
+    {
+        if ((ret=decode_line(state)))   // error, or File done
+        {
+            break;
+        }
+        // the reference line is used up: clip into it (<=w+2 elements), it becomes curline next
+        clip_line(state->curline,state->lastline,x,w);
+        rle_decode(state->lastline,outbuf,w);
+        swap_lines(state);
+    }
+    return (ret<0)?ret:iA;
+}
+
+// random access
+#define G4_INDEX_MAGIC "G4IX"
+
+G4INDEX *new_g4_index(int kval,int width)
+{
+    G4INDEX *ret=calloc(1,sizeof(G4INDEX));
+
+    if (!ret)
+    {
+        return NULL;
+    }
+    ret->kval=kval;
+    ret->width=(width<=0)?1728:width;
+    return ret;
+}
+
+void free_g4_index(G4INDEX *index)
+{
+    if (index)
+    {
+        free(index->lines);
+        free(index->bitpos);
+        free(index->offsets);
+        free(index->runs);
+        free(index);
+    }
+}
+
+// makes room for one more checkpoint with >num changing elements; returns 0 on success
+static int grow_g4_index(G4INDEX *index,int num)
+{
+    void *tmp;
+
+    if (index->num>=index->alloc)
+    {
+        const int alloc=(index->alloc)?2*index->alloc:64;
+        if ((tmp=realloc(index->lines,alloc*sizeof(int)))==NULL)
+        {
+            return -1;
+        }
+        index->lines=tmp;
+        if ((tmp=realloc(index->bitpos,alloc*sizeof(int64_t)))==NULL)
+        {
+            return -1;
+        }
+        index->bitpos=tmp;
+        if ((tmp=realloc(index->offsets,alloc*sizeof(int)))==NULL)
+        {
+            return -1;
+        }
+        index->offsets=tmp;
+        index->alloc=alloc;
+    }
+    if (index->runslen+num>index->runsalloc)
+    {
+        int alloc=(index->runsalloc)?2*index->runsalloc:4096;
+        while (alloc<index->runslen+num)
+        {
+            alloc*=2;
+        }
+        if ((tmp=realloc(index->runs,alloc*sizeof(int)))==NULL)
+        {
+            return -1;
+        }
+        index->runs=tmp;
+        index->runsalloc=alloc;
+    }
+    return 0;
+}
+
+// position in the stream, in bits
+static int64_t g4_bitpos(const G4STATE *state)
+{
+    if (state->encoding)
+    {
+        return (state->bufstart+state->buflen)*8+state->bitpos;
+    }
+    return (state->bufstart+state->bufpos)*8-state->bitpos;
+}
+
+int add_g4_checkpoint(G4STATE *state,G4INDEX *index)
+{
+    int num;
+
+    assert( (state)&&(index) );
+    if ( (!state)||(!index)||(state->width!=index->width)||(state->kval!=index->kval) )
+    {
+        return -ERR_INVALID_ARGUMENT;
+    }
+    for (num=0; state->lastline[num]<state->width; num++) ;
+    num++; // with the terminating >width
+    if (grow_g4_index(index,num))
+    {
+        return (state->encoding)?-ERR_WRITE:-ERR_READ;
+    }
+    index->lines[index->num]=state->lines_done;
+    index->bitpos[index->num]=g4_bitpos(state);
+    index->offsets[index->num]=index->runslen;
+    memcpy(index->runs+index->runslen,state->lastline,num*sizeof(int));
+    index->runslen+=num;
+    index->num++;
+    return 0;
+}
+
+// moves a decoder reading from memory to bit >bit of its input; returns 1 if that is beyond the end
+static int set_bitpos(G4STATE *state,int64_t bit)
+{
+    state->bufpos=bit>>3;
+    state->bitbuf=0;
+    state->bitpos=0;
+    fillbits(state,64);
+    if (state->bitpos<(bit&7))
+    {
+        return 1;
+    }
+    eat_bits(state,bit&7);
+    return 0;
+}
+
+int seek_g4(G4STATE *state,const G4INDEX *index,int line)
+{
+    int lo=0,hi,num,ret;
+
+    assert( (state)&&(index) );
+    if ( (!state)||(!index)||(state->encoding)||(!state->mem)||(line<0)||
+         (state->width!=index->width)||(state->kval!=index->kval) )
+    {
+        return -ERR_INVALID_ARGUMENT;
+    }
+    // last checkpoint at or before >line: lines[lo-1]<=line<lines[hi]
+    hi=index->num;
+    while (lo<hi)
+    {
+        const int mid=(lo+hi)/2;
+        if (index->lines[mid]<=line)
+        {
+            lo=mid+1;
+        }
+        else
+        {
+            hi=mid;
+        }
+    }
+    lo--;
+    // unless the decoder is already between there and >line
+    if ( (state->lines_done>line)||(state->lines_done<((lo>=0)?index->lines[lo]:0)) )
+    {
+        const int64_t bit=(lo>=0)?index->bitpos[lo]:0;
+        if ( (bit<0)||(bit>(int64_t)state->buflen*8) )
+        {
+            return -ERR_INVALID_ARGUMENT;
+        }
+        if (lo>=0)
+        {
+            const int *runs=index->runs+index->offsets[lo];
+            for (num=0; runs[num]<state->width; num++) ;
+            memcpy(state->lastline,runs,(num+1)*sizeof(int));
+            state->lastline[num+1]=state->width+1;
+            state->lines_done=index->lines[lo];
+        }
+        else     // from the start
+        {
+            state->lastline[0]=state->width;
+            state->lastline[1]=state->width+1;
+            state->lines_done=0;
+        }
+        if (set_bitpos(state,bit))
+        {
+            return 1;
+        }
+    }
+    num=line-state->lines_done;
+    ret=skip_g4(state,num);
+    return (ret<0)?ret:(ret<num);
+}
+
+static void put_be32(unsigned char *out,uint32_t val)
+{
+    out[0]=val>>24;
+    out[1]=val>>16;
+    out[2]=val>>8;
+    out[3]=val;
+}
+
+static uint32_t get_be32(const unsigned char *in)
+{
+    return ((uint32_t)in[0]<<24)|(in[1]<<16)|(in[2]<<8)|in[3];
+}
+
+// format (32 bit big endian): "G4IX",width,kval,num; for each checkpoint:
+// line, bitpos (2x), count, count changing elements (the last one is width)
+int write_g4_index(const G4INDEX *index,WRITEFUNC wf,void *user_write)
+{
+    unsigned char *buf,*out;
+    int iA,iB,ret;
+
+    assert( (index)&&(wf) );
+    if ( (!index)||(!wf) )
+    {
+        return -ERR_INVALID_ARGUMENT;
+    }
+    if ((buf=malloc(16+16*index->num+4*index->runslen))==NULL)
+    {
+        return -ERR_WRITE;
+    }
+    memcpy(buf,G4_INDEX_MAGIC,4);
+    put_be32(buf+4,index->width);
+    put_be32(buf+8,index->kval);
+    put_be32(buf+12,index->num);
+    out=buf+16;
+    for (iA=0; iA<index->num; iA++)
+    {
+        const int *runs=index->runs+index->offsets[iA];
+        const int num=((iA+1<index->num)?index->offsets[iA+1]:index->runslen)-index->offsets[iA];
+        put_be32(out,index->lines[iA]);
+        put_be32(out+4,(uint64_t)index->bitpos[iA]>>32);
+        put_be32(out+8,index->bitpos[iA]);
+        put_be32(out+12,num);
+        out+=16;
+        for (iB=0; iB<num; iB++,out+=4)
+        {
+            put_be32(out,runs[iB]);
+        }
+    }
+    ret=((*wf)(user_write,buf,out-buf))?-ERR_WRITE:0;
+    free(buf);
+    return ret;
+}
+
+// reads exactly >len bytes; returns 0 on success
+static int read_all(READFUNC2 rf,void *user_read,unsigned char *buf,int len)
+{
+    while (len>0)
+    {
+        const int ret=(*rf)(user_read,buf,len);
+        if (ret<=0)
+        {
+            return -1;
+        }
+        buf+=ret;
+        len-=ret;
+    }
+    return 0;
+}
+
+G4INDEX *read_g4_index(READFUNC2 rf,void *user_read)
+{
+    G4INDEX *ret;
+    unsigned char tmp[16];
+    int num,iA,iB;
+
+    assert(rf);
+    if ( (!rf)||(read_all(rf,user_read,tmp,16))||(memcmp(tmp,G4_INDEX_MAGIC,4)!=0)||((int)get_be32(tmp+4)<=0) )
+    {
+        return NULL;
+    }
+    if ((ret=new_g4_index(get_be32(tmp+8),get_be32(tmp+4)))==NULL)
+    {
+        return NULL;
+    }
+    num=get_be32(tmp+12);
+    for (iA=0; iA<num; iA++)
+    {
+        int *runs,count;
+        if (read_all(rf,user_read,tmp,16))
+        {
+            break;
+        }
+        count=get_be32(tmp+12);
+        if ( (count<1)||(count>ret->width+1)||(grow_g4_index(ret,count)) )
+        {
+            break;
+        }
+        ret->lines[iA]=get_be32(tmp);
+        ret->bitpos[iA]=((int64_t)get_be32(tmp+4)<<32)|get_be32(tmp+8);
+        ret->offsets[iA]=ret->runslen;
+        runs=ret->runs+ret->runslen;
+        for (iB=0; iB<count; iB++)
+        {
+            if (read_all(rf,user_read,tmp,4))
+            {
+                break;
+            }
+            runs[iB]=get_be32(tmp);
+            // ascending, only the last one is >width
+            if ( (runs[iB]<((iB)?runs[iB-1]:0))||((runs[iB]>=ret->width)!=(iB==count-1))||(runs[iB]>ret->width) )
+            {
+                break;
+            }
+        }
+        if ( (iB<count)||((iA)&&(ret->lines[iA]<ret->lines[iA-1]))||(ret->lines[iA]<0) )
+        {
+            break;
+        }
+        ret->runslen+=count;
+        ret->num++;
+    }
+    if (iA<num)   // truncated or corrupted
+    {
+        free_g4_index(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+// parallel coding
+#define G4_MIN_JOB_ROWS 32
+
+typedef struct G4JOBS
+{
+    void (*func)(void *arg,int job);
+    void *arg;
+    int num,next;
+#if G4_THREADS
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t lock;
+#endif
+#endif
+} G4JOBS;
+
+static int num_cpus(void)
+{
+#if G4_THREADS&&defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (info.dwNumberOfProcessors>0)?(int)info.dwNumberOfProcessors:1;
+#elif G4_THREADS&&defined(_SC_NPROCESSORS_ONLN)
+    long ret=sysconf(_SC_NPROCESSORS_ONLN);
+    return (ret>0)?(int)ret:1;
+#else
+    return 1;
+#endif
+}
+
+int g4_threads(int threads)
+{
+    return (threads>0)?threads:num_cpus();
+}
+
+#if G4_THREADS
+static int next_job(G4JOBS *jobs)
+{
+    int ret=-1;
+
+#ifdef _WIN32
+    EnterCriticalSection(&jobs->lock);
+#else
+    pthread_mutex_lock(&jobs->lock);
+#endif
+    if (jobs->next<jobs->num)
+    {
+        ret=jobs->next++;
+    }
+#ifdef _WIN32
+    LeaveCriticalSection(&jobs->lock);
+#else
+    pthread_mutex_unlock(&jobs->lock);
+#endif
+    return ret;
+}
+
+static void work_jobs(G4JOBS *jobs)
+{
+    int job;
+
+    while ((job=next_job(jobs))>=0)
+    {
+        (*jobs->func)(jobs->arg,job);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI job_thread(LPVOID arg)
+{
+    work_jobs((G4JOBS *)arg);
+    return 0;
+}
+#else
+static void *job_thread(void *arg)
+{
+    work_jobs((G4JOBS *)arg);
+    return NULL;
+}
+#endif
+#endif
+
+// calls >func(>arg,job) for job=0..num-1, on up to >threads threads (incl. the calling one)
+static void run_jobs(int threads,int num,void (*func)(void *arg,int job),void *arg)
+{
+    int iA;
+
+#if !G4_THREADS
+    (void)threads;
+#else
+    if (threads>num)
+    {
+        threads=num;
+    }
+    if (threads>1)
+    {
+        G4JOBS jobs;
+#ifdef _WIN32
+        HANDLE *tids=malloc(sizeof(HANDLE)*threads);
+#else
+        pthread_t *tids=malloc(sizeof(pthread_t)*threads);
+#endif
+        int started=0;
+
+        jobs.func=func;
+        jobs.arg=arg;
+        jobs.num=num;
+        jobs.next=0;
+        if (tids)
+        {
+#ifdef _WIN32
+            InitializeCriticalSection(&jobs.lock);
+            for (iA=0; iA<threads-1; iA++)
+            {
+                if ((tids[started]=CreateThread(NULL,0,job_thread,&jobs,0,NULL))!=NULL)
+                {
+                    started++;
+                }
+            }
+            work_jobs(&jobs);   // a failed CreateThread only costs speed
+            for (iA=0; iA<started; iA++)
+            {
+                WaitForSingleObject(tids[iA],INFINITE);
+                CloseHandle(tids[iA]);
+            }
+            DeleteCriticalSection(&jobs.lock);
+#else
+            pthread_mutex_init(&jobs.lock,NULL);
+            for (iA=0; iA<threads-1; iA++)
+            {
+                if (pthread_create(&tids[started],NULL,job_thread,&jobs)==0)
+                {
+                    started++;
+                }
+            }
+            work_jobs(&jobs);   // a failed pthread_create only costs speed
+            for (iA=0; iA<started; iA++)
+            {
+                pthread_join(tids[iA],NULL);
+            }
+            pthread_mutex_destroy(&jobs.lock);
+#endif
+            free(tids);
+            return;
+        }
+    }
+#endif
+    for (iA=0; iA<num; iA++)
+    {
+        (*func)(arg,iA);
+    }
+}
+
+// append >in[0..len) at the current bit position
+static int putbytes(G4STATE *state,const unsigned char *in,int len)
+{
+    int ret,iA;
+
+    while (len>=4)
+    {
+        unsigned char *out;
+        int num;
+        if ( (state->buflen+4>state->bufsize)&&((ret=writebuf(state))) )
+        {
+            return ret;
+        }
+        out=state->buf+state->buflen;
+        num=(state->bufsize-state->buflen)&~3;   // whole words that fit without writebuf
+        if (num>(len&~3))
+        {
+            num=len&~3;
+        }
+        if (!(state->bitpos&7))   // byte-aligned: the pending bytes, then a plain copy
+        {
+            const int pend=state->bitpos/8;
+            for (iA=0; iA<pend; iA++)
+            {
+                out[iA]=state->bitbuf>>(56-8*iA);
+            }
+            memcpy(out+pend,in,num-pend);
+            state->bitbuf=0;
+            for (iA=0; iA<pend; iA++)   // the last >pend bytes stay pending
+            {
+                state->bitbuf|=(uint64_t)in[num-pend+iA]<<(56-8*iA);
+            }
+        }
+        else
+        {
+            for (iA=0; iA<num; iA+=4)
+            {
+                state->bitbuf|=(uint64_t)(((uint32_t)in[iA]<<24)|((uint32_t)in[iA+1]<<16)|((uint32_t)in[iA+2]<<8)|in[iA+3])<<(32-state->bitpos);
+                out[iA]=state->bitbuf>>56;
+                out[iA+1]=state->bitbuf>>48;
+                out[iA+2]=state->bitbuf>>40;
+                out[iA+3]=state->bitbuf>>32;
+                state->bitbuf<<=32;
+            }
+        }
+        state->buflen+=num;
+        in+=num;
+        len-=num;
+    }
+    for (iA=0; iA<len; iA++)
+    {
+        if ((ret=putbits(state,in[iA],8)))
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// append everything collected by the memory sink >src, incl. its pending bits
+static int append_bits(G4STATE *state,const G4STATE *src)
+{
+    int ret;
+
+    if ((ret=putbytes(state,src->buf,src->buflen)))
+    {
+        return ret;
+    }
+    if (src->bitpos>0)   // <32
+    {
+        return putbits(state,(unsigned int)(src->bitbuf>>(64-src->bitpos)),src->bitpos);
+    }
+    return 0;
+}
+
+typedef struct
+{
+    const unsigned char *buf;
+    int height,stride,rows; // >rows per job
+    G4STATE **sinks;
+    int *rets;
+} G4ENCJOBS;
+
+static void encode_job(void *arg,int job)
+{
+    G4ENCJOBS *enc=(G4ENCJOBS *)arg;
+    G4STATE *sink=enc->sinks[job];
+    int end=(job+1)*enc->rows;
+
+    if (end>enc->height)
+    {
+        end=enc->height;
+    }
+    enc->rets[job]=encode_g4_image(sink,enc->buf+(size_t)job*enc->rows*enc->stride,end-job*enc->rows,enc->stride);
+}
+
+int encode_g4_parallel(G4STATE *state,const unsigned char *buf,int height,int stride,int threads)
+{
+    G4ENCJOBS enc;
+    int ret=0,iA,num;
+
+    assert(state);
+    if ( (!state)||(!state->encoding)||( (!buf)&&(height>0) ) )
+    {
+        return -ERR_INVALID_ARGUMENT;
+    }
+    if (threads<=0)
+    {
+        threads=num_cpus();
+    }
+    if ( (state->kval>0)&&(state->lines_done%state->kval!=0) )   // G3 2d: the rest of the current K-line group depends on the reference line
+    {
+        iA=state->kval-state->lines_done%state->kval;
+        if (iA>height)
+        {
+            iA=height;
+        }
+        if ((ret=encode_g4_image(state,buf,iA,stride)))
+        {
+            return ret;
+        }
+        buf+=(size_t)iA*stride;
+        height-=iA;
+    }
+    // a few jobs per thread even out lines of different complexity
+    enc.rows=(height+4*threads-1)/(4*threads);
+    if (enc.rows<G4_MIN_JOB_ROWS)
+    {
+        enc.rows=G4_MIN_JOB_ROWS;
+    }
+    if (state->kval>0)   // each job starts with a 1d line, like a fresh state
+    {
+        enc.rows+=state->kval-1;
+        enc.rows-=enc.rows%state->kval;
+    }
+    num=(height+enc.rows-1)/enc.rows;
+    if ( (state->kval<0)||(threads==1)||(num<2) )   // serially
+    {
+        return encode_g4_image(state,buf,height,stride);
+    }
+
+    enc.buf=buf;
+    enc.height=height;
+    enc.stride=stride;
+    enc.sinks=calloc(num,sizeof(G4STATE *));
+    enc.rets=malloc(sizeof(int)*num);
+    if ( (!enc.sinks)||(!enc.rets) )
+    {
+        free(enc.sinks);
+        free(enc.rets);
+        return -ERR_WRITE;
+    }
+    for (iA=0; iA<num; iA++)
+    {
+        if ((enc.sinks[iA]=init_g4_write_mem(state->kval,state->width,0))==NULL)
+        {
+            ret=-ERR_WRITE;
+            break;
+        }
+    }
+
+    if (!ret)
+    {
+        run_jobs(threads,num,encode_job,&enc);
+        for (iA=0; (iA<num)&&(!ret); iA++)
+        {
+            if ((ret=enc.rets[iA])==0)
+            {
+                ret=(append_bits(state,enc.sinks[iA]))?-ERR_WRITE:0;
+            }
+        }
+    }
+    if (!ret)   // continue after the last row, as the serial loop would
+    {
+        G4STATE *last=enc.sinks[num-1];
+        memcpy(state->lastline,last->lastline,sizeof(int)*(state->width+2));
+        memcpy(state->lastrow,last->lastrow,(state->width+7)/8);
+        state->lastrow_ok=last->lastrow_ok;
+        state->lines_done+=height;
+    }
+
+    for (iA=0; iA<num; iA++)
+    {
+        free_g4(enc.sinks[iA]);
+    }
+    free(enc.sinks);
+    free(enc.rets);
+    return ret;
+}
+
+// finds up to >max G3 EOLs (at least 11 0 bits, then a 1) that start at or after bit >start
+// of >buf[0..len); stores the positions of their final 1 bit to >eols[], returns their number
+static int find_eols(const unsigned char *buf,int len,int64_t start,int64_t *eols,int max)
+{
+    uint64_t lastzeros=0; // 0 bits of the previous word; none before >start
+    int64_t off;
+    int num=0,iA;
+
+    for (off=start>>3; (off<len)&&(num<max); off+=8)
+    {
+        const uint64_t word=(off+8<=len)?load_be64(buf+off):load_be64_part(buf+off,len-off);
+        const uint64_t zeros=~word;
+        uint64_t hits=word;
+
+        // 1 bits with 11 zeros in front: bit iA of a word is preceded by bit iA+1, resp. the last one of the word before
+        for (iA=1; iA<=11; iA++)
+        {
+            hits&=(zeros>>iA)|(lastzeros<<(64-iA));
+        }
+        while ( (hits)&&(num<max) )
+        {
+            const int bit=clz64(hits);
+            if (off*8+bit>=start+11)
+            {
+                eols[num++]=off*8+bit;
+            }
+            hits&=~((uint64_t)1<<(63-bit));
+        }
+        lastzeros=zeros;
+    }
+    return num;
+}
+
+// 1, if the bits >start .. >end-1 of >buf are all 0
+static int zero_bits(const unsigned char *buf,int64_t start,int64_t end)
+{
+    for (; (start<end)&&(start&7); start++)
+    {
+        if ((buf[start>>3]<<(start&7))&0x80)
+        {
+            return 0;
+        }
+    }
+    if (end-start>=8)
+    {
+        const size_t len=(size_t)((end-start)>>3);
+        if ((*skip_fill)(buf+(start>>3),len,0x00)!=len)
+        {
+            return 0;
+        }
+        start+=len*8;
+    }
+    for (; start<end; start++)
+    {
+        if ((buf[start>>3]<<(start&7))&0x80)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+typedef struct
+{
+    const G4STATE *state;
+    unsigned char *outbuf;
+    int stride;
+    const int64_t *starts; // bit position of the first EOL of each job
+    const int *first;      // first row of each job, and the end
+    G4STATE **decs;
+    int *rets;
+} G4DECJOBS;
+
+static void decode_job(void *arg,int job)
+{
+    G4DECJOBS *dec=(G4DECJOBS *)arg;
+    G4STATE *src;
+
+    if ((src=init_g4_read_mem(dec->state->kval,dec->state->width,dec->state->buf,dec->state->buflen))==NULL)
+    {
+        dec->rets[job]=-ERR_READ;
+        return;
+    }
+    dec->decs[job]=src;
+    if (job==0)   // G3 2d: may continue the reference line of >state
+    {
+        memcpy(src->lastline,dec->state->lastline,sizeof(int)*(dec->state->width+2));
+    }
+    src->lines_done=dec->state->lines_done+dec->first[job];
+    if (set_bitpos(src,dec->starts[job]))
+    {
+        dec->rets[job]=-ERR_READ;
+        return;
+    }
+    dec->rets[job]=decode_g4_image(src,dec->outbuf+(size_t)dec->first[job]*dec->stride,dec->first[job+1]-dec->first[job],dec->stride);
+}
+
+int decode_g4_parallel(G4STATE *state,unsigned char *outbuf,int height,int stride,int threads)
+{
+    G4DECJOBS dec;
+    int64_t *eols,*starts;
+    int *first,ret=0,rows,num,found,iA;
+
+    assert(state);
+    if ( (!state)||(state->encoding)||( (!outbuf)&&(height>0) ) )
+    {
+        return -ERR_INVALID_ARGUMENT;
+    }
+    if (threads<=0)
+    {
+        threads=num_cpus();
+    }
+    // a few jobs per thread even out lines of different complexity
+    rows=(height+4*threads-1)/(4*threads);
+    if (rows<G4_MIN_JOB_ROWS)
+    {
+        rows=G4_MIN_JOB_ROWS;
+    }
+    if ( (state->kval<0)||(!state->mem)||(threads==1)||(height<2*rows) )   // serially
+    {
+        return decode_g4_image(state,outbuf,height,stride);
+    }
+
+    // every G3 line starts with an EOL. in 1d all of them, in 2d those followed by
+    // a 1 tag bit (1d coded line, no reference) start independent runs of lines
+    if ((eols=malloc(sizeof(int64_t)*height))==NULL)
+    {
+        return -ERR_READ;
+    }
+    found=find_eols(state->buf,state->buflen,g4_bitpos(state),eols,height);
+    if ( (found==0)||(!zero_bits(state->buf,g4_bitpos(state),eols[0])) )   // not at an EOL: the serial decoder reports it
+    {
+        free(eols);
+        return decode_g4_image(state,outbuf,height,stride);
+    }
+    num=(found+rows-1)/rows;
+    starts=malloc(sizeof(int64_t)*num);
+    first=malloc(sizeof(int)*(num+1));
+    dec.decs=calloc(num,sizeof(G4STATE *));
+    dec.rets=malloc(sizeof(int)*num);
+    if ( (!starts)||(!first)||(!dec.decs)||(!dec.rets) )
+    {
+        ret=-ERR_READ;
+    }
+    else
+    {
+        int line=0;
+
+        // jobs of about >rows rows, each one up to the next 1d line
+        for (num=0; line<found; num++)
+        {
+            first[num]=line;
+            starts[num]=eols[line]-11;
+            for (line+=rows; line<found; line++)
+            {
+                const int64_t tag=eols[line]+1;
+                if ( (state->kval==0)||( (tag>>3<state->buflen)&&((state->buf[tag>>3]<<(tag&7))&0x80) ) )
+                {
+                    break;
+                }
+            }
+        }
+        first[num]=height;   // the last job reads on to the end resp. an error, as the serial loop
+    }
+    if ( (!ret)&&(num<2) )
+    {
+        ret=decode_g4_image(state,outbuf,height,stride);
+    }
+    else if (!ret)
+    {
+        dec.state=state;
+        dec.outbuf=outbuf;
+        dec.stride=stride;
+        dec.starts=starts;
+        dec.first=first;
+        run_jobs(threads,num,decode_job,&dec);
+
+        int resync=0;
+
+        // the rows up to the first error resp. End-Of-File count
+        for (iA=0; iA<num; iA++)
+        {
+            if ( (dec.rets[iA]<0)||(dec.rets[iA]<first[iA+1]-first[iA]) )
+            {
+                break;
+            }
+            // corrupt data may have moved the line boundaries: then the serial decoder does not
+            // get to the EOL the next job started at (only fill bits may be in between)
+            if (iA<num-1)
+            {
+                const int64_t end=g4_bitpos(dec.decs[iA]);
+                if ( (end>starts[iA+1])||(!zero_bits(state->buf,end,starts[iA+1])) )
+                {
+                    resync=1;
+                    break;
+                }
+            }
+        }
+        if (iA==num)
+        {
+            iA--;
+        }
+        if ((ret=dec.rets[iA])<0)
+        {
+            state->lines_done=(dec.decs[iA])?dec.decs[iA]->lines_done:state->lines_done+first[iA];
+        }
+        else     // continue after the last row, as the serial loop would
+        {
+            const G4STATE *last=dec.decs[iA];
+            memcpy(state->lastline,last->lastline,sizeof(int)*(state->width+2));
+            state->bufpos=last->bufpos;
+            state->bitbuf=last->bitbuf;
+            state->bitpos=last->bitpos;
+            state->lines_done=last->lines_done;
+            ret=first[iA]+ret;
+            if (resync)   // the rest of the rows serially, from where this job stopped
+            {
+                const int more=decode_g4_image(state,outbuf+(size_t)ret*stride,height-ret,stride);
+                ret=(more<0)?more:ret+more;
+            }
+        }
+    }
+
+    if (dec.decs)
+    {
+        for (iA=0; iA<num; iA++)
+        {
+            free_g4(dec.decs[iA]);
+        }
+    }
+    free(dec.decs);
+    free(dec.rets);
+    free(first);
+    free(starts);
+    free(eols);
+    return ret;
+}
+
+typedef struct
+{
+    int kval,width;
+    const unsigned char *buf;
+    int height,stride,rows; // >rows per strip
+    unsigned char **data;
+    int *counts,*rets;
+} G4STRIPJOBS;
+
+static void strip_job(void *arg,int job)
+{
+    G4STRIPJOBS *enc=(G4STRIPJOBS *)arg;
+    G4STATE *sink;
+    int ret,end=(job+1)*enc->rows;
+
+    if (end>enc->height)
+    {
+        end=enc->height;
+    }
+    if ((sink=init_g4_write_mem(enc->kval,enc->width,0))==NULL)
+    {
+        enc->rets[job]=-ERR_WRITE;
+        return;
+    }
+    ret=encode_g4_image(sink,enc->buf+(size_t)job*enc->rows*enc->stride,end-job*enc->rows,enc->stride);
+    if (!ret)
+    {
+        ret=encode_g4(sink,NULL);
+    }
+    if (!ret)
+    {
+        enc->data[job]=take_g4_mem(sink,&enc->counts[job]);
+    }
+    free_g4(sink);
+    enc->rets[job]=ret;
+}
+
+int encode_g4_strips(int kval,int width,const unsigned char *buf,int height,int stride,int rows,int threads,G4STRIPS *strips)
+{
+    G4STRIPJOBS enc;
+    int ret=0,iA,pos;
+
+    assert(strips);
+    if (!strips)
+    {
+        return -ERR_INVALID_ARGUMENT;
+    }
+    strips->num=0;
+    strips->data=NULL;
+    strips->offsets=strips->counts=NULL;
+    if ( ( (!buf)&&(height>0) )||(height<0)||(rows<=0) )
+    {
+        return -ERR_INVALID_ARGUMENT;
+    }
+    if (width<=0)   // use default
+    {
+        width=1728;
+    }
+    if (threads<=0)
+    {
+        threads=num_cpus();
+    }
+    strips->num=(height+rows-1)/rows;
+    strips->offsets=malloc(sizeof(int)*(strips->num+1));
+    strips->counts=malloc(sizeof(int)*(strips->num+1));
+    enc.kval=kval;
+    enc.width=width;
+    enc.buf=buf;
+    enc.height=height;
+    enc.stride=stride;
+    enc.rows=rows;
+    enc.data=calloc(strips->num+1,sizeof(unsigned char *));
+    enc.counts=strips->counts;
+    enc.rets=malloc(sizeof(int)*(strips->num+1));
+    if ( (!strips->offsets)||(!strips->counts)||(!enc.data)||(!enc.rets) )
+    {
+        ret=-ERR_WRITE;
+    }
+    else
+    {
+        init_tables();
+        run_jobs(threads,strips->num,strip_job,&enc);
+        for (iA=0,pos=0; (iA<strips->num)&&(!ret); iA++)
+        {
+            ret=enc.rets[iA];
+            strips->offsets[iA]=pos;
+            pos+=strips->counts[iA];
+        }
+    }
+    if (!ret)   // strips back to back
+    {
+        strips->data=malloc(pos+1);
+        if (!strips->data)
+        {
+            ret=-ERR_WRITE;
+        }
+        for (iA=0; (iA<strips->num)&&(!ret); iA++)
+        {
+            memcpy(strips->data+strips->offsets[iA],enc.data[iA],strips->counts[iA]);
+        }
+    }
+
+    if (enc.data)
+    {
+        for (iA=0; iA<strips->num; iA++)
+        {
+            free(enc.data[iA]);
+        }
+    }
+    free(enc.data);
+    free(enc.rets);
+    if (ret)
+    {
+        free_g4_strips(strips);
+    }
+    return ret;
+}
+
+void free_g4_strips(G4STRIPS *strips)
+{
+    if (strips)
+    {
+        free(strips->data);
+        free(strips->offsets);
+        free(strips->counts);
+        strips->data=NULL;
+        strips->offsets=strips->counts=NULL;
+        strips->num=0;
+    }
+}
@@ -1,30 +1,54 @@
 #ifndef _G4CODE_H
 #define _G4CODE_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-// have to return 0 on success, !=0 on error
+// have to return 0 on success, !=0 on error (READFUNC: when not all >len bytes can be read)
 typedef int (*WRITEFUNC)(void *user,unsigned char *buf,int len);
 typedef int (*READFUNC)(void *user,unsigned char *buf,int len);
+// has to return the number of bytes read (<len only at end of input), <0 on error
+typedef int (*READFUNC2)(void *user,unsigned char *buf,int len);
 
 typedef struct G4STATE
 {
-    READFUNC read;
+    READFUNC2 read;
+    READFUNC read_old; // init_g4_read: called for single bytes instead of >read
     WRITEFUNC write;
     int width;
     int kval;
     void *user_read,*user_write;
     int *lastline,*curline;
+    unsigned char *lastrow; // encoding: previous input row
+    int lastrow_ok; // encoding: 0 when >lastrow is not the row of >lastline (see encode_g4_runs)
     int lines_done,bitpos;
-    unsigned int bitbuf;
+    uint64_t bitbuf; // MSB-aligned
+    unsigned char *buf; // encoding: collects output until it is handed to >write
+                        // decoding: input block, refilled by >read
+    int bufsize,buflen,bufpos;
+    int64_t bufstart; // stream offset of >buf[0]
+    int encoding; // set up by init_g4_write*
+    int mem; // no >read/>write: >buf is the caller's whole input (decoding) resp.
+             // grows to keep the whole output (encoding)
 } G4STATE;
 
 // kval==-1 means G4-code, kval=0 means G3 1dim, kval>0 G3 2dim with K=>kval
 // width<=0 means default (1728)
 G4STATE *init_g4_read(int kval,int width,READFUNC rf,void *user_read);
 G4STATE *init_g4_write(int kval,int width,WRITEFUNC wf,void *user_write);
+// The same with block I/O: bufsize<=0 means default (4096): input is requested from >rf
+// resp. output is passed to >wf in blocks of this size
+G4STATE *init_g4_read2(int kval,int width,int bufsize,READFUNC2 rf,void *user_read);
+G4STATE *init_g4_write2(int kval,int width,int bufsize,WRITEFUNC wf,void *user_write);
+// The same without callbacks: the decoder reads >buf[0..len) in place (it has to stay
+// valid until free_g4), the encoder keeps all output in a growing buffer; initial size >bufsize.
+G4STATE *init_g4_read_mem(int kval,int width,const unsigned char *buf,int len);
+G4STATE *init_g4_write_mem(int kval,int width,int bufsize);
+// hands the output collected so far (*len bytes; NULL when empty) to the caller, who has to free() it
+unsigned char *take_g4_mem(G4STATE *state,int *len);
 void restart_g4(G4STATE *state);
 void free_g4(G4STATE *state);
 
@@ -35,11 +59,99 @@ void free_g4(G4STATE *state);
 // >inbuf resp. >outbuf have to be ceil(width/8) bytes big
 //
 // When the image is done, call encode_g4 once more with >inbuf==NULL to
-// finish up the stream
+// finish up the stream; only then all pending output is passed to >wf
 int encode_g4(G4STATE *state,const unsigned char *inbuf);
-// maybe we read 1 byte too much!
+// the decoder reads ahead up to >bufsize (init_g4_read: 8) bytes beyond the end of the stream!
 int decode_g4(G4STATE *state,unsigned char *outbuf);
 
+// Like encode_g4/decode_g4, but the line is given as its changing elements:
+// the ascending pixel positions where the color changes, starting from white
+// (i.e. a leading 0 for a black first pixel), terminated by >width.
+// >runs has to hold up to width+1 ints.
+int encode_g4_runs(G4STATE *state,const int *runs);
+int decode_g4_runs(G4STATE *state,int *runs);
+
+// Like decode_g4, but instead of the bitmap the line's black pixels are counted per block
+// of 1<<shift columns and added to >sums[0 .. ((width+(1<<shift)-1)>>shift)-1], e.g. for
+// area-averaged downscaling. The bitmap is never filled in.
+int decode_g4_sums(G4STATE *state,int *sums,int shift);
+
+// Decodes all of >in and encodes it with >out (same width, any kval), line by line as
+// changing elements; finishes >out like encode_g4(out,NULL).
+// returns the number of lines, <0 on Error
+int transcode_g4(G4STATE *in,G4STATE *out);
+
+// Whole-image versions of encode_g4/decode_g4 for >height rows, >stride bytes apart.
+// encode_g4_image returns 0 on success, <0 on Error (the stream still has to be finished
+// with encode_g4(state,NULL)).
+// decode_g4_image returns the number of rows decoded (<height only at End-Of-File),
+// <0 on Error (>state->lines_done then tells how far it got).
+int encode_g4_image(G4STATE *state,const unsigned char *inbuf,int height,int stride);
+int decode_g4_image(G4STATE *state,unsigned char *outbuf,int height,int stride);
+
+// Region of interest: decodes up to >lines lines without filling in a bitmap;
+// returns the number of lines skipped (<lines only at End-Of-File), <0 on Error
+int skip_g4(G4STATE *state,int lines);
+// Like decode_g4_image, but only the columns >x .. >x+>w-1 are filled in: column >x
+// becomes the first pixel of each row of ceil(w/8) bytes. Call it only for the rows
+// needed: the stream is not read any further.
+int decode_g4_region(G4STATE *state,unsigned char *outbuf,int height,int stride,int x,int w);
+
+// Random access: checkpoints tell where a line starts in the stream (in bits) and
+// what its reference line is, so decoding can resume there
+typedef struct G4INDEX
+{
+    int width,kval;
+    int num,alloc;
+    int *lines;      // checkpoint iA is for line >lines[iA] (ascending)
+    int64_t *bitpos; // ... which starts at this bit of the stream
+    int *offsets;    // ... and its reference line is >runs[offsets[iA]], up to >width
+    int *runs;
+    int runslen,runsalloc;
+} G4INDEX;
+
+G4INDEX *new_g4_index(int kval,int width);
+void free_g4_index(G4INDEX *index);
+// records the current position of >state (encoding or decoding), i.e. that of line
+// >state->lines_done, as a checkpoint; e.g. every N lines between encode_g4_image calls
+// returns 0 on success, <0 on Error
+int add_g4_checkpoint(G4STATE *state,G4INDEX *index);
+// moves a decoder reading from memory (init_g4_read_mem) to line >line, resuming at the last
+// checkpoint before it (or the start) and skipping the lines from there
+// returns 0 on success, 1 if the stream ends before, <0 on Error
+int seek_g4(G4STATE *state,const G4INDEX *index,int line);
+// (de)serialize, e.g. as a sidecar file: 0 on success resp. NULL on Error
+int write_g4_index(const G4INDEX *index,WRITEFUNC wf,void *user_write);
+G4INDEX *read_g4_index(READFUNC2 rf,void *user_read);
+
+// the number of threads the functions below use for >threads (<=0: one per cpu)
+int g4_threads(int threads);
+
+// Encodes >height rows, >stride bytes apart, starting at >buf; same output as
+// calling encode_g4 for each of them.
+// G3 lines are coded on >threads threads (<=0: one per cpu): each line (1d) resp.
+// each group of K lines (2d) is independent. G4 lines are coded serially.
+int encode_g4_parallel(G4STATE *state,const unsigned char *buf,int height,int stride,int threads);
+
+// Decodes up to >height rows like decode_g4_image. A G3 stream in memory (init_g4_read_mem)
+// is split at its EOLs (G3 2d: only in front of 1d coded lines) and decoded on >threads
+// threads (<=0: one per cpu), G4 and streamed input serially.
+int decode_g4_parallel(G4STATE *state,unsigned char *outbuf,int height,int stride,int threads);
+
+// Strips of >rows rows (the last one may be shorter) are independent images, e.g. in TIFF
+typedef struct G4STRIPS
+{
+    int num;
+    unsigned char *data;  // all strips back to back
+    int *offsets,*counts; // strip iA is >data[offsets[iA]] .. >data[offsets[iA]+counts[iA]-1]
+} G4STRIPS;
+
+// Encodes each strip of the >height rows (>stride bytes apart) at >buf as a complete
+// stream of its own, on >threads threads (<=0: one per cpu).
+// returns 0 on success (release >strips with free_g4_strips), <0 on Error
+int encode_g4_strips(int kval,int width,const unsigned char *buf,int height,int stride,int rows,int threads,G4STRIPS *strips);
+void free_g4_strips(G4STRIPS *strips);
+
 #define ERR_INVALID_ARGUMENT 1
 #define ERR_READ             2
 #define ERR_WRITE            3
@@ -12,6 +12,9 @@
 #define LZW_MINBITS  9
 #define LZW_MAXBITS 12 // max 12 because of table=32 bit
 #define LZW_HASHSIZE 9001  // at least 1<<MAXBITS, should be prime 
+#define LZW_MEMSIZE 4096 // initial size of the memory sink
+#define LZW_MEM_SOURCE 1
+#define LZW_MEM_SINK   2
 
 // accessors to table[]-values
 #define NEXTBYTE(a)   ((a)&0xff)
@@ -43,6 +46,10 @@ LZWSTATE *init_lzw(int earlychange,READFUNC rf,WRITEFUNC wf,void *user_read,void
 
     ret->earlychange=earlychange;
 
+    ret->mem=0;
+    ret->buf=NULL;
+    ret->bufsize=ret->buflen=ret->bufpos=0;
+
     ret->table=malloc(tablesize*sizeof(unsigned int));
     if (!ret->table)
     {
@@ -81,6 +88,63 @@ LZWSTATE *init_lzw_write(int earlychange,WRITEFUNC wf,void *user_write)
     return init_lzw(earlychange,NULL,wf,NULL,user_write,LZW_HASHSIZE,NULL);
 }
 
+LZWSTATE *init_lzw_read_mem(int earlychange,const unsigned char *buf,int len)
+{
+    LZWSTATE *ret;
+    unsigned char *stack;
+
+    assert( (buf)||(len==0) );
+    if ( (!buf)&&(len!=0) )
+    {
+        return 0;
+    }
+    stack=malloc((1<<LZW_MAXBITS)*sizeof(unsigned char));
+    if (!stack)
+    {
+        return NULL;
+    }
+    ret=init_lzw(earlychange,NULL,NULL,NULL,NULL,1<<LZW_MAXBITS,stack);
+    if (!ret)
+    {
+        free(stack);
+        return NULL;
+    }
+    ret->mem=LZW_MEM_SOURCE;
+    ret->buf=(unsigned char *)buf; // only read
+    ret->buflen=len;
+    return ret;
+}
+
+LZWSTATE *init_lzw_write_mem(int earlychange)
+{
+    LZWSTATE *ret=init_lzw(earlychange,NULL,NULL,NULL,NULL,LZW_HASHSIZE,NULL);
+
+    if (ret)
+    {
+        ret->mem=LZW_MEM_SINK;
+    }
+    return ret;
+}
+
+unsigned char *take_lzw_mem(LZWSTATE *state,int *len)
+{
+    unsigned char *ret;
+
+    assert(state);
+    if ( (!state)||(state->mem!=LZW_MEM_SINK) )
+    {
+        return NULL;
+    }
+    ret=state->buf;
+    if (len)
+    {
+        *len=state->buflen;
+    }
+    state->buf=NULL; // grows again from scratch
+    state->bufsize=state->buflen=0;
+    return ret;
+}
+
 void restart_lzw(LZWSTATE *state)
 {
     assert(state);
@@ -102,6 +166,10 @@ void free_lzw(LZWSTATE *state)
     {
         free(state->stackend-(1<<LZW_MAXBITS)); // look at init_lzw !
         free(state->table);
+        if (state->mem==LZW_MEM_SINK)
+        {
+            free(state->buf);
+        }
         free(state);
     }
 }
@@ -110,19 +178,31 @@ void free_lzw(LZWSTATE *state)
 static int readbits(LZWSTATE *state)
 {
     int ret,iA;
-    unsigned char buf[4];
+    unsigned char buf[4],*in=buf;
 
     if (state->bitpos<state->codebits)   // ensure enough bits
     {
         int num=(state->codebits-state->bitpos+7)/8;
-        ret=(*state->read)(state->user_read,buf,num);
-        if (ret)
+        if (state->mem)   // straight from the caller's input
         {
-            return -1;
+            if (state->bufpos+num>state->buflen)
+            {
+                return -1;
+            }
+            in=state->buf+state->bufpos;
+            state->bufpos+=num;
+        }
+        else
+        {
+            ret=(*state->read)(state->user_read,buf,num);
+            if (ret)
+            {
+                return -1;
+            }
         }
         for (iA=0; iA<num; iA++)
         {
-            state->bitbuf|=buf[iA]<<(24-state->bitpos);
+            state->bitbuf|=in[iA]<<(24-state->bitpos);
             state->bitpos+=8;
         }
     }
@@ -132,19 +212,56 @@ static int readbits(LZWSTATE *state)
     return ret;
 }
 
+// memory sink: make sure there is room for >len more bytes
+static int growbuf(LZWSTATE *state,int len)
+{
+    unsigned char *tmp;
+    int size=(state->bufsize>0)?state->bufsize:LZW_MEMSIZE;
+
+    while (state->buflen+len>size)
+    {
+        size*=2;
+    }
+    if (size==state->bufsize)
+    {
+        return 0;
+    }
+    tmp=realloc(state->buf,size);
+    if (!tmp)
+    {
+        return -1;
+    }
+    state->buf=tmp;
+    state->bufsize=size;
+    return 0;
+}
+
 static int writecode(LZWSTATE *state,unsigned int code)
 {
-    unsigned char buf[4];
+    unsigned char buf[4],*out=buf;
     int iA=0;
 
+    if (state->mem)   // straight into the output
+    {
+        if ( (state->buflen+4>state->bufsize)&&(growbuf(state,4)) )
+        {
+            return -1;
+        }
+        out=state->buf+state->buflen;
+    }
     state->bitbuf|=code<<(32-state->bitpos-state->codebits);
     state->bitpos+=state->codebits;
     while (state->bitpos>=8)
     {
-        buf[iA++]=state->bitbuf>>24;
+        out[iA++]=state->bitbuf>>24;
         state->bitbuf<<=8;
         state->bitpos-=8;
     }
+    if (state->mem)
+    {
+        state->buflen+=iA;
+        return 0;
+    }
     if (!iA)
     {
         return 0;
@@ -164,6 +281,15 @@ static int writeflush(LZWSTATE *state)
     c=state->bitbuf>>24;
     state->bitbuf=0;
     state->bitpos=0;
+    if (state->mem)
+    {
+        if (growbuf(state,1))
+        {
+            return -1;
+        }
+        state->buf[state->buflen++]=c;
+        return 0;
+    }
     return (*state->write)(state->user_write,&c,1);
 }
 
@@ -195,7 +321,7 @@ static inline int find_add_hash(LZWSTATE *state,int prefixcode,unsigned char nex
 }
 
 // TODO: check errors from writecode
-int encode_lzw(LZWSTATE *state,unsigned char *buf,int len)
+int encode_lzw(LZWSTATE *state,const unsigned char *buf,int len)
 {
     assert(state);
     assert(len>=0);
@@ -26,16 +26,27 @@ typedef struct LZWSTATE
 
     int bitpos;
     unsigned int bitbuf;
+
+    // memory source/sink (init_lzw_*_mem), no >read/>write
+    int mem; // 1: source, 2: sink
+    unsigned char *buf; // decoding: the caller's input; encoding: the output, grows as needed
+    int bufsize,buflen,bufpos;
 } LZWSTATE;
 
 LZWSTATE *init_lzw_read(int earlychange,READFUNC rf,void *user_read);
 LZWSTATE *init_lzw_write(int earlychange,WRITEFUNC wf,void *user_write);
+// The same without callbacks: the decoder reads >buf[0..len) in place (it has to stay
+// valid until free_lzw), the encoder keeps all output in a growing buffer
+LZWSTATE *init_lzw_read_mem(int earlychange,const unsigned char *buf,int len);
+LZWSTATE *init_lzw_write_mem(int earlychange);
+// hands the output collected so far (*len bytes; NULL when empty) to the caller, who has to free() it
+unsigned char *take_lzw_mem(LZWSTATE *state,int *len);
 void restart_lzw(LZWSTATE *state);
 void free_lzw(LZWSTATE *state);
 
 // return 0 on success, <0 on error
 // to finish the stream: call once with >buf==NULL
-int encode_lzw(LZWSTATE *state,unsigned char *buf,int len);
+int encode_lzw(LZWSTATE *state,const unsigned char *buf,int len);
 // returns 1+len(really decoded) on EOD
 int decode_lzw(LZWSTATE *state,unsigned char *buf,int len);
 // TODO: error: "Warning: EOD missing, EOF came first\n"
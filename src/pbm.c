@@ -1,36 +1,223 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <assert.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__)||defined(_M_X64)||(defined(_M_IX86_FP)&&(_M_IX86_FP>=2))
+#include <emmintrin.h>
+#define PBM_SSE2 1
+#endif
 #include "pbm.h"
 
-int read_pbm(const char *filename,unsigned char **buf,int *width,int *height)
+// read-ahead of a stream
+#define PBM_INBUF 65536
+
+// refills the window of a stream; returns the bytes available, 0 at EOF resp. for memory
+static int pbm_fill(PBMIN *in)
 {
-    FILE *f=stdin;
-    int iA,iB,plain;
-    char tmp[256],c;
-    unsigned char iC,*out;
+    size_t len;
 
-    assert( (buf)&&(width)&&(height) );
-    if (filename)
+    if (!in->f)
+    {
+        return 0;
+    }
+    if ( (!in->buf)&&((in->buf=malloc(PBM_INBUF))==NULL) )
+    {
+        return 0;
+    }
+    len=fread(in->buf,1,PBM_INBUF,in->f);
+    in->pos=in->buf;
+    in->end=in->buf+len;
+    return len;
+}
+
+static inline int pbm_getc(PBMIN *in)
+{
+    if ( (in->pos<in->end)||(pbm_fill(in)>0) )
+    {
+        return *in->pos++;
+    }
+    return EOF;
+}
+
+// reads >len bytes, the rest of the window first; returns 0 on success
+static int pbm_read(PBMIN *in,unsigned char *buf,size_t len)
+{
+    size_t num=in->end-in->pos;
+
+    if (num>len)
+    {
+        num=len;
+    }
+    memcpy(buf,in->pos,num);
+    in->pos+=num;
+    if ( (num<len)&&( (!in->f)||(fread(buf+num,1,len-num,in->f)!=len-num) ) )
+    {
+        return -2;
+    }
+    return 0;
+}
+
+static inline int is_space(int c)
+{
+    return (c==' ')||(c=='\r')||(c=='\n')||(c=='\t');
+}
+
+#ifdef PBM_SSE2
+// bit order reversed
+static const unsigned char bitrev[256]=
+{
+    0x00,0x80,0x40,0xc0,0x20,0xa0,0x60,0xe0,0x10,0x90,0x50,0xd0,0x30,0xb0,0x70,0xf0,
+    0x08,0x88,0x48,0xc8,0x28,0xa8,0x68,0xe8,0x18,0x98,0x58,0xd8,0x38,0xb8,0x78,0xf8,
+    0x04,0x84,0x44,0xc4,0x24,0xa4,0x64,0xe4,0x14,0x94,0x54,0xd4,0x34,0xb4,0x74,0xf4,
+    0x0c,0x8c,0x4c,0xcc,0x2c,0xac,0x6c,0xec,0x1c,0x9c,0x5c,0xdc,0x3c,0xbc,0x7c,0xfc,
+    0x02,0x82,0x42,0xc2,0x22,0xa2,0x62,0xe2,0x12,0x92,0x52,0xd2,0x32,0xb2,0x72,0xf2,
+    0x0a,0x8a,0x4a,0xca,0x2a,0xaa,0x6a,0xea,0x1a,0x9a,0x5a,0xda,0x3a,0xba,0x7a,0xfa,
+    0x06,0x86,0x46,0xc6,0x26,0xa6,0x66,0xe6,0x16,0x96,0x56,0xd6,0x36,0xb6,0x76,0xf6,
+    0x0e,0x8e,0x4e,0xce,0x2e,0xae,0x6e,0xee,0x1e,0x9e,0x5e,0xde,0x3e,0xbe,0x7e,0xfe,
+    0x01,0x81,0x41,0xc1,0x21,0xa1,0x61,0xe1,0x11,0x91,0x51,0xd1,0x31,0xb1,0x71,0xf1,
+    0x09,0x89,0x49,0xc9,0x29,0xa9,0x69,0xe9,0x19,0x99,0x59,0xd9,0x39,0xb9,0x79,0xf9,
+    0x05,0x85,0x45,0xc5,0x25,0xa5,0x65,0xe5,0x15,0x95,0x55,0xd5,0x35,0xb5,0x75,0xf5,
+    0x0d,0x8d,0x4d,0xcd,0x2d,0xad,0x6d,0xed,0x1d,0x9d,0x5d,0xdd,0x3d,0xbd,0x7d,0xfd,
+    0x03,0x83,0x43,0xc3,0x23,0xa3,0x63,0xe3,0x13,0x93,0x53,0xd3,0x33,0xb3,0x73,0xf3,
+    0x0b,0x8b,0x4b,0xcb,0x2b,0xab,0x6b,0xeb,0x1b,0x9b,0x5b,0xdb,0x3b,0xbb,0x7b,0xfb,
+    0x07,0x87,0x47,0xc7,0x27,0xa7,0x67,0xe7,0x17,0x97,0x57,0xd7,0x37,0xb7,0x77,0xf7,
+    0x0f,0x8f,0x4f,0xcf,0x2f,0xaf,0x6f,0xef,0x1f,0x9f,0x5f,0xdf,0x3f,0xbf,0x7f,0xff
+};
+#endif
+
+// ORs the top >count (<=16) bits of >val into >out at bit >bit
+static inline void put_bits16(unsigned char *out,int bit,uint32_t val,int count)
+{
+    const int end=(bit&7)+count;
+
+    out+=bit>>3;
+    val>>=bit&7;
+    out[0]|=val>>24;
+    if (end>8)
     {
-        if ((f=fopen(filename,"rb"))==NULL)
+        out[1]|=val>>16;
+    }
+    if (end>16)
+    {
+        out[2]|=val>>8;
+    }
+}
+
+int ascii_to_bits(const unsigned char *text,int len,unsigned char *out,int bit,int num,int *got)
+{
+    int pos=0,n=0;
+
+    while ( (n<num)&&(pos<len) )
+    {
+#ifdef PBM_SSE2
+        if ( (len-pos>=16)&&(num-n>=16) )   // 16 characters at once
+        {
+            const __m128i chars=_mm_loadu_si128((const __m128i *)(text+pos));
+            const unsigned int ones=_mm_movemask_epi8(_mm_cmpeq_epi8(chars,_mm_set1_epi8('1')));
+            const unsigned int digits=ones|_mm_movemask_epi8(_mm_cmpeq_epi8(chars,_mm_set1_epi8('0')));
+
+            if (digits==0xffff)   // the common case: no whitespace. movemask has the first character in bit 0
+            {
+                put_bits16(out,bit+n,((uint32_t)bitrev[ones&0xff]<<24)|((uint32_t)bitrev[ones>>8]<<16),16);
+                n+=16;
+                pos+=16;
+                continue;
+            }
+            else
+            {
+                const __m128i space=_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chars,_mm_set1_epi8(' ')),_mm_cmpeq_epi8(chars,_mm_set1_epi8('\n'))),
+                                                 _mm_or_si128(_mm_cmpeq_epi8(chars,_mm_set1_epi8('\r')),_mm_cmpeq_epi8(chars,_mm_set1_epi8('\t'))));
+                if ((digits|_mm_movemask_epi8(space))==0xffff)   // line breaks: drop them
+                {
+                    uint32_t val=0;
+                    int count=0,iA;
+
+                    for (iA=0; iA<16; iA++)
+                    {
+                        if (digits&(1<<iA))
+                        {
+                            val|=(uint32_t)((ones>>iA)&1)<<(31-count);
+                            count++;
+                        }
+                    }
+                    if (count)
+                    {
+                        put_bits16(out,bit+n,val,count);
+                    }
+                    n+=count;
+                    pos+=16;
+                    continue;
+                }
+            }
+            // else: the scalar code finds the bad character
+        }
+#endif
+        if (text[pos]=='1')
         {
+            out[(bit+n)>>3]|=0x80>>((bit+n)&7);
+            n++;
+        }
+        else if (text[pos]=='0')
+        {
+            n++;
+        }
+        else if (!is_space(text[pos]))
+        {
+            *got=n;
             return -1;
         }
+        pos++;
+    }
+    *got=n;
+    return pos;
+}
+
+// the 8 digits of each byte value
+#define PBM_DIGITS(n) {'0'+(((n)>>7)&1),'0'+(((n)>>6)&1),'0'+(((n)>>5)&1),'0'+(((n)>>4)&1), \
+                       '0'+(((n)>>3)&1),'0'+(((n)>>2)&1),'0'+(((n)>>1)&1),'0'+((n)&1)}
+#define PBM_DIGITS4(n) PBM_DIGITS(n),PBM_DIGITS((n)+1),PBM_DIGITS((n)+2),PBM_DIGITS((n)+3)
+#define PBM_DIGITS16(n) PBM_DIGITS4(n),PBM_DIGITS4((n)+4),PBM_DIGITS4((n)+8),PBM_DIGITS4((n)+12)
+#define PBM_DIGITS64(n) PBM_DIGITS16(n),PBM_DIGITS16((n)+16),PBM_DIGITS16((n)+32),PBM_DIGITS16((n)+48)
+static const char digits[256][8]= {PBM_DIGITS64(0),PBM_DIGITS64(64),PBM_DIGITS64(128),PBM_DIGITS64(192)};
+
+void bits_to_ascii(const unsigned char *buf,int len,char *text)
+{
+    int iA;
+
+    for (iA=0; iA<len; iA++,text+=8)
+    {
+        memcpy(text,digits[buf[iA]],8);
     }
+}
+
+static int read_header(PBMIN *in,int *plain,int *width,int *height)
+{
+    int iA,iB,c;
 
-    fread(tmp,2,1,f);
-    if (tmp[0]!='P')
+    if (pbm_getc(in)!='P')
     {
         return -2;
     }
-    if (tmp[1]=='1')   // P1
+    c=pbm_getc(in);
+    if (c=='1')   // P1
     {
-        plain=1;
+        *plain=1;
     }
-    else if (tmp[1]=='4')     // P4
+    else if (c=='4')     // P4
     {
-        plain=0;
+        *plain=0;
     }
     else
     {
@@ -41,12 +228,12 @@ int read_pbm(const char *filename,unsigned char **buf,int *width,int *height)
     // skip to number
     do
     {
-        c=getc(f);
+        c=pbm_getc(in);
         if (c=='#')
         {
-            while (c!='\n')
+            while ( (c!='\n')&&(c!=EOF) )
             {
-                c=getc(f);
+                c=pbm_getc(in);
             }
         }
     }
@@ -56,7 +243,7 @@ int read_pbm(const char *filename,unsigned char **buf,int *width,int *height)
     while ( (c>='0')&&(c<='9') )
     {
         iA=(iA*10)+(c-'0');
-        c=getc(f);
+        c=pbm_getc(in);
     }
     if (!iA)
     {
@@ -65,14 +252,14 @@ int read_pbm(const char *filename,unsigned char **buf,int *width,int *height)
     // skip ws
     while ( (c==' ')||(c=='\r')||(c=='\n')||(c=='\t') )
     {
-        c=getc(f);
+        c=pbm_getc(in);
     }
     // read height
     iB=0;
     while ( (c>='0')&&(c<='9') )
     {
         iB=(iB*10)+(c-'0');
-        c=getc(f);
+        c=pbm_getc(in);
     }
     if (!iB)
     {
@@ -82,89 +269,432 @@ int read_pbm(const char *filename,unsigned char **buf,int *width,int *height)
     {
         return -2;
     }
+    *width=iA;
+    *height=iB;
+    return 0;
+}
+
+static int read_plain(PBMIN *in,unsigned char *out,int width,int height)
+{
+    const int bwidth=(width+7)/8;
+    int iA,done,got,used;
+
+    for (iA=0; iA<height; iA++,out+=bwidth)
+    {
+        memset(out,0,bwidth);
+        for (done=0; done<width; done+=got)
+        {
+            if ( (in->pos>=in->end)&&(pbm_fill(in)<=0) )   // EOF
+            {
+                return -2;
+            }
+            if ((used=ascii_to_bits(in->pos,in->end-in->pos,out,done,width-done,&got))<0)
+            {
+                return -2;
+            }
+            in->pos+=used;
+        }
+    }
+    return 0;
+}
+
+int read_pbm(const char *filename,unsigned char **buf,int *width,int *height)
+{
+    PBMIN in= {stdin,NULL,NULL,NULL};
+    int iA,iB,plain,ret;
+
+    assert( (buf)&&(width)&&(height) );
+    if (filename)
+    {
+        if ((in.f=fopen(filename,"rb"))==NULL)
+        {
+            return -1;
+        }
+    }
 
-    // allocate buffer, if necessary
-    if (*buf)
+    ret=read_header(&in,&plain,&iA,&iB);
+    if (!ret)
     {
-        if (iA*iB>(*width)*(*height))
+        // allocate buffer, if necessary
+        if (*buf)
+        {
+            if (iA*iB>(*width)*(*height))
+            {
+                free(*buf);
+                *buf=malloc((iA+7)/8*iB);
+            }
+        }
+        else
         {
-            free(*buf);
             *buf=malloc((iA+7)/8*iB);
         }
+        if (!*buf)   // malloc failed
+        {
+            ret=-3;
+        }
+    }
+    if (!ret)
+    {
+        *width=iA;
+        *height=iB;
+
+        if (plain)
+        {
+            ret=read_plain(&in,*buf,iA,iB);
+        }
+        else
+        {
+            const int bwidth=(iA+7)/8;
+            ret=pbm_read(&in,*buf,(size_t)bwidth*iB);   // short file: -2
+        }
+    }
+
+    if (filename)
+    {
+        fclose(in.f);
+    }
+    free(in.buf);
+    return ret;
+}
+
+MAPFILE *map_file(const char *filename)
+{
+    MAPFILE *ret;
+    long long size,start=0;
+#ifdef _WIN32
+    HANDLE file,mapping;
+    LARGE_INTEGER fsize;
+
+    if (filename)
+    {
+        file=CreateFileA(filename,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
     }
     else
     {
-        *buf=malloc((iA+7)/8*iB);
+        file=(HANDLE)_get_osfhandle(_fileno(stdin));
+        start=_telli64(_fileno(stdin));
     }
-    if (!*buf)   // malloc failed
+    if (file==INVALID_HANDLE_VALUE)
     {
-        return -3;
+        return NULL;
     }
-    *width=iA;
-    *height=iB;
+    size=( (GetFileType(file)==FILE_TYPE_DISK)&&(GetFileSizeEx(file,&fsize)) )?fsize.QuadPart:0;
+    if ( (start<0)||(size-start<=0)||(size>INT_MAX) )
+    {
+        mapping=NULL;
+    }
+    else
+    {
+        mapping=CreateFileMapping(file,NULL,PAGE_READONLY,0,0,NULL);
+    }
+    if (filename)   // the mapping keeps it open
+    {
+        CloseHandle(file);
+    }
+    if (!mapping)
+    {
+        return NULL;
+    }
+    if ((ret=malloc(sizeof(MAPFILE)))==NULL)
+    {
+        CloseHandle(mapping);
+        return NULL;
+    }
+    ret->mapping=mapping;
+    ret->base=MapViewOfFile(mapping,FILE_MAP_READ,0,0,0);
+    if (!ret->base)
+    {
+        CloseHandle(mapping);
+        free(ret);
+        return NULL;
+    }
+#else
+    struct stat st;
+    int fd=(filename)?open(filename,O_RDONLY):fileno(stdin);
+
+    if (fd<0)
+    {
+        return NULL;
+    }
+    if (!filename)   // stdin may already be partially read
+    {
+        start=lseek(fd,0,SEEK_CUR);
+    }
+    size=( (fstat(fd,&st)==0)&&(S_ISREG(st.st_mode)) )?st.st_size:0;
+    if ( (start<0)||(size-start<=0)||(size>INT_MAX)||((ret=malloc(sizeof(MAPFILE)))==NULL) )
+    {
+        if (filename)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    ret->mapping=NULL;
+    ret->base=mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (filename)   // the mapping keeps it open
+    {
+        close(fd);
+    }
+    if (ret->base==MAP_FAILED)
+    {
+        free(ret);
+        return NULL;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(ret->base,size,MADV_SEQUENTIAL);
+#endif
+#endif
+    ret->maplen=size;
+    ret->mem=NULL;
+    ret->data=(const unsigned char *)ret->base+start;
+    ret->len=size-start;
+    return ret;
+}
 
-    if (plain)
+void unmap_file(MAPFILE *map)
+{
+    if (!map)
     {
-        out=*buf;
-        for (; iB>0; iB--)
+        return;
+    }
+    if (map->mem)
+    {
+        free(map->mem);
+    }
+    else
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(map->base);
+        CloseHandle(map->mapping);
+#else
+        munmap(map->base,map->maplen);
+#endif
+    }
+    free(map);
+}
+
+int map_pbm(const char *filename,MAPFILE **map,const unsigned char **buf,int *width,int *height)
+{
+    MAPFILE *ret=map_file(filename);
+    unsigned char *mem=NULL;
+    int plain,err;
+
+    assert( (map)&&(buf)&&(width)&&(height) );
+    if (ret)
+    {
+        PBMIN in= {NULL,ret->data,ret->data+ret->len,NULL};
+
+        err=read_header(&in,&plain,width,height);
+        if ( (!err)&&(plain) )
         {
-            for (iA=*width; iA>0;)
+            if ((mem=malloc((*width+7)/8*(*height)))==NULL)
             {
-                *out=0;
-                for (iC=0x80; (iC>0)&&(iA>0); iC>>=1,iA--)
-                {
-                    do
-                    {
-                        c=fgetc(f);
-                    }
-                    while ( (c==' ')||(c=='\r')||(c=='\n')||(c=='\t') );
-                    if (c=='1')
-                    {
-                        *out|=iC;
-                    }
-                    else if (c!='0')
-                    {
-                        return -2;
-                    }
-                }
-                out++;
+                err=-3;
+            }
+            else
+            {
+                err=read_plain(&in,mem,*width,*height);
             }
         }
+        else if ( (!err)&&(in.end-in.pos<(long long)(*width+7)/8*(*height)) )   // truncated
+        {
+            err=-2;
+        }
+        if (err)
+        {
+            free(mem);
+            unmap_file(ret);
+            return err;
+        }
+        if (mem)   // P1: the bitmap lives in mem, the mapping is done
+        {
+            unmap_file(ret);
+            ret=NULL;
+        }
+        else
+        {
+            *buf=in.pos;
+            *map=ret;
+            return 0;
+        }
     }
-    else
+    else if ((err=read_pbm(filename,&mem,width,height))!=0)   // pipe: read as usual
+    {
+        free(mem);
+        return err;
+    }
+    if ((ret=malloc(sizeof(MAPFILE)))==NULL)
     {
-        const int bwidth=(*width+7)/8;
-        fread(*buf,bwidth,*height,f);
+        free(mem);
+        return -3;
     }
+    ret->base=ret->mem=mem;
+    ret->maplen=ret->len=(*width+7)/8*(*height);
+    ret->mapping=NULL;
+    *buf=ret->data=mem;
+    *map=ret;
+    return 0;
+}
 
-    if (filename)
+int open_pbm_reader(const char *filename,PBMREADER **pr)
+{
+    PBMREADER *ret;
+    int err;
+
+    assert(pr);
+    if ((ret=calloc(1,sizeof(PBMREADER)))==NULL)
     {
-        fclose(f);
+        return -3;
+    }
+    if ((ret->map=map_file(filename))!=NULL)
+    {
+        ret->in.pos=ret->map->data;
+        ret->in.end=ret->map->data+ret->map->len;
+    }
+    else if (!filename)
+    {
+        ret->in.f=stdin;
     }
-    return 0; // TODO: check returncodes
+    else if ((ret->in.f=fopen(filename,"rb"))==NULL)
+    {
+        free(ret);
+        return -1;
+    }
+    ret->close=(filename)&&(ret->in.f);
+    if ((err=read_header(&ret->in,&ret->plain,&ret->width,&ret->height))!=0)
+    {
+        close_pbm_reader(ret);
+        return err;
+    }
+    *pr=ret;
+    return 0;
 }
 
-void writebits(FILE *f,unsigned char c,unsigned char endbit)
+int read_pbm_rows(PBMREADER *pr,const unsigned char **rows,int num)
 {
-    unsigned char iA;
-    for (iA=0x80; iA>endbit; iA>>=1)
+    const int bwidth=(pr->width+7)/8;
+    int err=0;
+
+    assert( (pr)&&(rows) );
+    if (num>pr->height-pr->rows)
     {
-        if (c&iA)
+        num=pr->height-pr->rows;
+    }
+    if (num<=0)
+    {
+        return 0;
+    }
+    if ( (!pr->plain)&&(!pr->in.f) )   // in place
+    {
+        if (pr->in.end-pr->in.pos<(long long)bwidth*num)   // truncated
         {
-            putc('1',f);
+            return -2;
         }
-        else
+        *rows=pr->in.pos;
+        pr->in.pos+=(size_t)bwidth*num;
+        pr->rows+=num;
+        return num;
+    }
+    if (num>pr->bufrows)
+    {
+        free(pr->buf);
+        if ((pr->buf=malloc((size_t)bwidth*num))==NULL)
+        {
+            pr->bufrows=0;
+            return -3;
+        }
+        pr->bufrows=num;
+    }
+    if (pr->plain)
+    {
+        err=read_plain(&pr->in,pr->buf,pr->width,num);
+    }
+    else
+    {
+        err=pbm_read(&pr->in,pr->buf,(size_t)bwidth*num);
+    }
+    if (err)
+    {
+        return err;
+    }
+    *rows=pr->buf;
+    pr->rows+=num;
+    return num;
+}
+
+int next_pbm_image(PBMREADER *pr)
+{
+    const unsigned char *rows;
+    int ret,c;
+
+    assert(pr);
+    while ((ret=read_pbm_rows(pr,&rows,256))>0)   // skip the rest of this one
+    {
+    }
+    if (ret<0)
+    {
+        return ret;
+    }
+    do
+    {
+        c=pbm_getc(&pr->in);
+    }
+    while ( (c==' ')||(c=='\r')||(c=='\n')||(c=='\t') );
+    if (c==EOF)
+    {
+        return 1;
+    }
+    pr->in.pos--;   // c came from the window
+    pr->rows=0;
+    return read_header(&pr->in,&pr->plain,&pr->width,&pr->height);
+}
+
+void close_pbm_reader(PBMREADER *pr)
+{
+    if (pr)
+    {
+        if (pr->close)
         {
-            putc('0',f);
+            fclose(pr->in.f);
         }
+        unmap_file(pr->map);
+        free(pr->in.buf);
+        free(pr->buf);
+        free(pr);
     }
 }
 
+// writes >height rows of packed pixels as P1 resp. P4 data; returns 0 on success
+static int write_rows(FILE *f,const unsigned char *buf,int width,int height,int plain)
+{
+    const int bwidth=(width+7)/8;
+    char *line;
+    int iA;
+
+    if (!plain)   // P4
+    {
+        fwrite(buf,bwidth,height,f);
+        return 0;
+    }
+    // P1: one line per row
+    if ((line=malloc(8*bwidth+1))==NULL)
+    {
+        return -1;
+    }
+    for (iA=0; iA<height; iA++,buf+=bwidth)
+    {
+        bits_to_ascii(buf,bwidth,line);
+        line[width]='\n';   // over the padding
+        fwrite(line,1,width+1,f);
+    }
+    free(line);
+    return 0;
+}
+
 int write_pbm(const char *filename,unsigned char *buf,int width,int height,int plain)
 {
     FILE *f=stdout;
-    int iA,iB;
-    const int bwidth=(width+7)/8,bmod=((width-1)&7)+1;
+    int ret;
 
     if (filename)
     {
@@ -173,30 +703,208 @@ int write_pbm(const char *filename,unsigned char *buf,int width,int height,int p
             return -1;
         }
     }
-    if (plain)   // P1
+    fprintf(f,"P%c %d %d\n",(plain)?'1':'4',width,height);
+    ret=write_rows(f,buf,width,height,plain);
+    if (filename)
     {
-        fprintf(f,"P1 %d %d\n",width,height);
-        for (iA=0; iA<height; iA++)
+        fclose(f);
+    }
+    return ret; // TODO: check returncodes
+}
+
+// rows held back for a pipe: blocks of about 1MB
+#define PBM_CHUNK (1<<20)
+
+PBMWRITER *open_pbm_writer(const char *filename,int width,int height,int plain)
+{
+    PBMWRITER *ret;
+    int regular;
+
+    if ((ret=calloc(1,sizeof(PBMWRITER)))==NULL)
+    {
+        return NULL;
+    }
+    ret->f=stdout;
+    if ( (filename)&&((ret->f=fopen(filename,"wb"))==NULL) )
+    {
+        free(ret);
+        return NULL;
+    }
+    ret->width=width;
+    ret->height=height;
+    ret->plain=plain;
+    ret->hdrpos=-1;
+    ret->chunkrows=PBM_CHUNK/((width+7)/8)+1;
+#ifdef _WIN32
+    regular=(GetFileType((HANDLE)_get_osfhandle(_fileno(ret->f)))==FILE_TYPE_DISK);
+#else
+    {
+        struct stat st;
+        regular=( (fstat(fileno(ret->f),&st)==0)&&(S_ISREG(st.st_mode)) );
+    }
+#endif
+    if (height>0)
+    {
+        fprintf(ret->f,"P%c %d %d\n",(plain)?'1':'4',width,height);
+    }
+    else if (regular)   // room for any height, patched by close_pbm_writer
+    {
+        fprintf(ret->f,"P%c %d ",(plain)?'1':'4',width);
+        ret->hdrpos=ftell(ret->f);
+        fprintf(ret->f,"%10d\n",0);
+    }
+    return ret;
+}
+
+int write_pbm_rows(PBMWRITER *pw,const unsigned char *buf,int rows)
+{
+    const int bwidth=(pw->width+7)/8;
+
+    if ( (pw->height>0)&&(rows>pw->height-pw->rows) )   // the header is out already
+    {
+        rows=pw->height-pw->rows;
+    }
+    if ( (pw->height>0)||(pw->hdrpos>=0) )
+    {
+        pw->rows+=rows;
+        return ( (write_rows(pw->f,buf,pw->width,rows,pw->plain))||(ferror(pw->f)) )?-1:0;
+    }
+    while (rows>0)   // keep them
+    {
+        const int pos=pw->rows%pw->chunkrows,num=(rows<pw->chunkrows-pos)?rows:pw->chunkrows-pos;
+
+        if (pos==0)
         {
-            for (iB=1; iB<bwidth; iB++)
+            if (pw->numchunks>=pw->chunkalloc)
+            {
+                const int alloc=(pw->chunkalloc)?2*pw->chunkalloc:16;
+                unsigned char **tmp=realloc(pw->chunks,sizeof(unsigned char *)*alloc);
+                if (!tmp)
+                {
+                    return -1;
+                }
+                pw->chunks=tmp;
+                pw->chunkalloc=alloc;
+            }
+            if ((pw->chunks[pw->numchunks]=malloc((size_t)pw->chunkrows*bwidth))==NULL)
             {
-                writebits(f,*buf++,0);
+                return -1;
             }
-            // incomplete byte
-            writebits(f,*buf++,0x80>>bmod);
-            putc('\n',f);
+            pw->numchunks++;
         }
+        memcpy(pw->chunks[pw->numchunks-1]+(size_t)pos*bwidth,buf,(size_t)num*bwidth);
+        buf+=(size_t)num*bwidth;
+        pw->rows+=num;
+        rows-=num;
     }
-    else     // P4
+    return 0;
+}
+
+int close_pbm_writer(PBMWRITER *pw)
+{
+    int ret=0,iA;
+
+    if (!pw)
     {
-        fprintf(f,"P4 %d %d\n",width,height);
-        fwrite(buf,bwidth,height,f);
+        return 0;
     }
+    if (pw->height>0)
+    {
+        // short input: white rows keep the promised size
+        const int bwidth=(pw->width+7)/8;
+        unsigned char *white=calloc(1,bwidth);
+
+        if (!white)
+        {
+            ret=-1;
+        }
+        for (; (white)&&(pw->rows<pw->height); pw->rows++)
+        {
+            if (write_rows(pw->f,white,pw->width,1,pw->plain))
+            {
+                ret=-1;
+            }
+        }
+        free(white);
+    }
+    else if (pw->hdrpos>=0)
+    {
+        fflush(pw->f);
+        if (fseek(pw->f,pw->hdrpos,SEEK_SET)==0)
+        {
+            fprintf(pw->f,"%10d",pw->rows);
+        }
+        else
+        {
+            ret=-1;
+        }
+    }
+    else
+    {
+        fprintf(pw->f,"P%c %d %d\n",(pw->plain)?'1':'4',pw->width,pw->rows);
+        for (iA=0; iA<pw->numchunks; iA++)
+        {
+            const int rows=(iA<pw->numchunks-1)?pw->chunkrows:pw->rows-iA*pw->chunkrows;
+            if (write_rows(pw->f,pw->chunks[iA],pw->width,rows,pw->plain))
+            {
+                ret=-1;
+            }
+        }
+    }
+    for (iA=0; iA<pw->numchunks; iA++)
+    {
+        free(pw->chunks[iA]);
+    }
+    free(pw->chunks);
+    if (ferror(pw->f))
+    {
+        ret=-1;
+    }
+    if (pw->f!=stdout)
+    {
+        if (fclose(pw->f))
+        {
+            ret=-1;
+        }
+    }
+    else if (fflush(pw->f))
+    {
+        ret=-1;
+    }
+    free(pw);
+    return ret;
+}
+
+int write_pgm(const char *filename,const unsigned char *buf,int width,int height)
+{
+    FILE *f=stdout;
+    int ret=0;
+
     if (filename)
     {
-        fclose(f);
+        if ((f=fopen(filename,"wb"))==NULL)
+        {
+            return -1;
+        }
+    }
+    fprintf(f,"P5 %d %d 255\n",width,height);
+    fwrite(buf,width,height,f);
+    if (ferror(f))
+    {
+        ret=-1;
+    }
+    if (filename)
+    {
+        if (fclose(f))
+        {
+            ret=-1;
+        }
+    }
+    else if (fflush(f))
+    {
+        ret=-1;
     }
-    return 0; // TODO: check returncodes
+    return ret;
 }
 
 /*
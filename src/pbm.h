@@ -1,10 +1,87 @@
 #ifndef _PBM_H
 #define _PBM_H
 
+#include <stddef.h>
+#include <stdio.h>
+
 // return 0 on success
 // if >filename==NULL stdin resp. stdout is used
 // read will allocate memory if *buf==NULL or free and allocate if (*width+7)/8*(*height) too small
 int read_pbm(const char *filename,unsigned char **buf,int *width,int *height);
 int write_pbm(const char *filename,unsigned char *buf,int width,int height,int plain);
+// 8 bit grayscale (P5), 0 is black
+int write_pgm(const char *filename,const unsigned char *buf,int width,int height);
+
+// '0'/'1' text <-> packed bits (MSB first), for plain pbm and bitstrings
+// packs up to >num digits of >text[0..len) into >out from bit >bit on (those bits must be 0),
+// skipping whitespace. returns the characters used and sets *got to the digits, -1 on anything else
+int ascii_to_bits(const unsigned char *text,int len,unsigned char *out,int bit,int num,int *got);
+// writes the 8*len digits of >buf[0..len) to >text
+void bits_to_ascii(const unsigned char *buf,int len,char *text);
+
+// row-wise output: the header is written at once if >height (>0) is known. otherwise a regular
+// file gets a placeholder height, patched on close, and rows for a pipe are kept until then
+typedef struct {
+    FILE *f;
+    int width,height,plain;
+    int rows;     // written so far
+    // private
+    long hdrpos;  // offset of the placeholder height, -1: none
+    unsigned char **chunks;
+    int numchunks,chunkalloc,chunkrows;
+} PBMWRITER;
+
+// >filename==NULL: stdout
+PBMWRITER *open_pbm_writer(const char *filename,int width,int height,int plain);
+// >rows packed rows of (width+7)/8 bytes; rows beyond a known height are dropped
+int write_pbm_rows(PBMWRITER *pw,const unsigned char *buf,int rows);
+// rows missing to a known height are written white; returns 0 on success
+int close_pbm_writer(PBMWRITER *pw);
+
+// read-only view of a whole input file
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    // private
+    void *base;
+    size_t maplen;
+    void *mem;     // malloc()ed data instead of a mapping
+    void *mapping; // win32 mapping handle
+} MAPFILE;
+
+// maps >filename (NULL: the rest of stdin); returns NULL if it is no regular file
+// (pipe, empty, >2GB,...) or can't be opened: then read it through stdio
+MAPFILE *map_file(const char *filename);
+void unmap_file(MAPFILE *map);
+
+// like read_pbm, but the P4 data of a regular file is used in place: *buf points into *map,
+// other input is read into memory owned by *map. release with unmap_file(*map)
+int map_pbm(const char *filename,MAPFILE **map,const unsigned char **buf,int *width,int *height);
+
+// row-wise input of one or more concatenated images (P4 or P1)
+typedef struct {
+    FILE *f;
+    const unsigned char *pos,*end; // the mapping resp. a window of >buf
+    unsigned char *buf;
+} PBMIN;  // private: a stream or memory
+
+typedef struct {
+    int width,height,plain; // of the current image
+    int rows;               // read so far
+    // private
+    PBMIN in;
+    MAPFILE *map;
+    unsigned char *buf;     // rows not used in place
+    int bufrows,close;
+} PBMREADER;
+
+// >filename==NULL: stdin; reads the first header. returns 0 on success, error codes as read_pbm
+int open_pbm_reader(const char *filename,PBMREADER **pr);
+// makes up to >num rows of the current image available at *rows (in place for a regular P4 file),
+// valid until the next call. returns their number (0: end of the image), <0 on error
+int read_pbm_rows(PBMREADER *pr,const unsigned char **rows,int num);
+// skips to the next image: returns 0 when its header was read, 1 at the end of the input, <0 on error
+int next_pbm_image(PBMREADER *pr);
+void close_pbm_reader(PBMREADER *pr);
 
 #endif
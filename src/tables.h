@@ -247,25 +247,4 @@ ENCHUFF opcode[MAX_OP]=
     { 7,0x0400}, // OP_VL3
     { 7,0x0200}  // OP_EXT
 };
-
-// Table for RLE-encoding
-int rlecode[128]=
-{
-    0x00000008,0x00000017,0x00000116,0x00000026,0x00000215,0x00001115,0x00000125,0x00000035,
-    0x00000314,0x00001214,0x00011114,0x00002114,0x00000224,0x00001124,0x00000134,0x00000044,
-    0x00000413,0x00001313,0x00011213,0x00002213,0x00021113,0x00111113,0x00012113,0x00003113,
-    0x00000323,0x00001223,0x00011123,0x00002123,0x00000233,0x00001133,0x00000143,0x00000053,
-    0x00000512,0x00001412,0x00011312,0x00002312,0x00021212,0x00111212,0x00012212,0x00003212,
-    0x00031112,0x00121112,0x01111112,0x00211112,0x00022112,0x00112112,0x00013112,0x00004112,
-    0x00000422,0x00001322,0x00011222,0x00002222,0x00021122,0x00111122,0x00012122,0x00003122,
-    0x00000332,0x00001232,0x00011132,0x00002132,0x00000242,0x00001142,0x00000152,0x00000062,
-    0x00000611,0x00001511,0x00011411,0x00002411,0x00021311,0x00111311,0x00012311,0x00003311,
-    0x00031211,0x00121211,0x01111211,0x00211211,0x00022211,0x00112211,0x00013211,0x00004211,
-    0x00041111,0x00131111,0x01121111,0x00221111,0x02111111,0x11111111,0x01211111,0x00311111,
-    0x00032111,0x00122111,0x01112111,0x00212111,0x00023111,0x00113111,0x00014111,0x00005111,
-    0x00000521,0x00001421,0x00011321,0x00002321,0x00021221,0x00111221,0x00012221,0x00003221,
-    0x00031121,0x00121121,0x01111121,0x00211121,0x00022121,0x00112121,0x00013121,0x00004121,
-    0x00000431,0x00001331,0x00011231,0x00002231,0x00021131,0x00111131,0x00012131,0x00003131,
-    0x00000341,0x00001241,0x00011141,0x00002141,0x00000251,0x00001151,0x00000161,0x00000071
-};
 #endif
@@ -0,0 +1,223 @@
+#!/bin/sh
+# Round-trip checks for faxg4coder: generated images are encoded and decoded
+# in all the ways the tool offers; every result is compared with the source.
+# usage: tests/roundtrip.sh [path/to/faxg4coder]
+
+CODER=${1:-./faxg4coder}
+GOLDEN=`dirname "$0"`/golden
+TMP=${TMPDIR:-/tmp}/faxcoder-test.$$
+LC_ALL=C
+export LC_ALL
+
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' 0
+fail=0
+count=0
+
+# check DESCRIPTION COMMAND: runs COMMAND with sh, which has to succeed
+check()
+{
+    count=$((count+1))
+    if ! eval "$2" >"$TMP/log" 2>&1
+    then
+        echo "FAIL: $1"
+        sed 's/^/    /' "$TMP/log"
+        fail=$((fail+1))
+    fi
+}
+
+# samepbm P1 FILE: FILE holds the image P1; a file written by the decoder may have the
+# height padded with spaces (filled in after the last row)
+samepbm()
+{
+    awk 'NR==1 { $1=$1 } { print }' "$2" | cmp "$1" -
+}
+
+# corrupt ERR ARGS: decoding with ARGS has to stop with exit code 2, reporting error ERR;
+# the rows decoded up to there go to $TMP/corrupt.pbm
+corrupt()
+{
+    err=$1
+    shift
+    $CODER "$@" >"$TMP/corrupt.pbm" 2>"$TMP/err"
+    ret=$?
+    cat "$TMP/err"
+    [ $ret -eq 2 ] && grep -q "error: $err\$" "$TMP/err"
+}
+
+# gen W H: plain pbm with runs of random length, blank, black, repeated and shifted rows
+gen()
+{
+    awk -v w="$1" -v h="$2" 'BEGIN {
+        x=12345
+        for (i=0; i<w; i++) { zeros=zeros "0"; ones=ones "1" }
+        printf "P1 %d %d\n",w,h
+        for (y=0; y<h; y++)
+        {
+            if (y%50>=10 && y%50<15) row=zeros
+            else if (y%97==40) row=ones
+            else if (y>0 && y%7==3) ;   # the same as the row before
+            else if (y>0 && y%7==5) row=substr(row,2) "0"
+            else
+            {
+                row=""; black=0
+                for (n=0; n<w; n+=len)
+                {
+                    x=(x*69069+1)%4294967296
+                    len=1+int(x/65536)%(black?12:90)
+                    if (n+len>w) len=w-n
+                    row=row substr(black?ones:zeros,1,len)
+                    black=1-black
+                }
+            }
+            print row
+        }
+    }'
+}
+
+# crop X Y W H < P1 > P1
+crop()
+{
+    awk -v x="$1" -v y="$2" -v w="$3" -v h="$4" '
+        NR==1 { printf "P1 %d %d\n",w,h; next }
+        NR-2>=y && NR-2<y+h { print substr($0,x+1,w) }'
+}
+
+# preview S < P1 > P5: the average gray of each SxS block, like -preview
+preview()
+{
+    awk -v s="$1" '
+        function flush(   iB,cols,area) {
+            for (iB=0; iB<gw; iB++)
+            {
+                cols=(width-iB*s<s)?width-iB*s:s
+                area=cols*lines
+                printf "%c",255-int((sums[iB]*255+int(area/2))/area)
+                sums[iB]=0
+            }
+            lines=0
+        }
+        NR==1 { width=$2; gw=int((width+s-1)/s); printf "P5 %d %d 255\n",gw,int(($3+s-1)/s); next }
+        {
+            for (iA=0; iA<width; iA++) if (substr($0,iA+1,1)=="1") sums[int(iA/s)]++
+            if (++lines==s) flush()
+        }
+        END { if (lines) flush() }'
+}
+
+for width in 1728 1731
+do
+    height=601
+    img="$TMP/img$width"
+    gen $width $height >"$img.p1"
+    crop 37 123 301 222 <"$img.p1" >"$img.crop"
+    preview 4 <"$img.p1" >"$img.pgm"
+
+    for code in g3 g32 g34 g4
+    do
+        c="$img.$code"
+        dec="-$code -decode$width"
+
+        # P1 vs P4, file vs pipe, serial vs threads
+        check "$code $width: encode P1" "$CODER -$code $img.p1 $c"
+        check "$code $width: decode to P1" "$CODER $dec -p $c $c.p1 && samepbm $img.p1 $c.p1"
+        check "$code $width: decode to P4" "$CODER $dec $c $c.p4"
+        check "$code $width: encode P4" "$CODER -$code $c.p4 $c.from4 && cmp $c $c.from4"
+        check "$code $width: encode from a pipe" "cat $img.p1 | $CODER -$code >$c.pipe && cmp $c $c.pipe"
+        check "$code $width: decode from a pipe" "cat $c | $CODER $dec -p | cmp $img.p1 -"
+        check "$code $width: encode on 1 thread" "$CODER -$code -threads1 $img.p1 $c.t1 && cmp $c $c.t1"
+        check "$code $width: encode on 4 threads" "$CODER -$code -threads4 $img.p1 $c.t4 && cmp $c $c.t4"
+        check "$code $width: decode on 1 thread" "$CODER $dec -p -threads1 $c $c.t1.p1 && samepbm $img.p1 $c.t1.p1"
+        check "$code $width: decode on 4 threads" "$CODER $dec -p -threads4 $c $c.t4.p1 && samepbm $img.p1 $c.t4.p1"
+        check "$code $width: bitstrings" "$CODER -$code -b $img.p1 $c.b && $CODER $dec -b -p $c.b | cmp $img.p1 -"
+
+        # region, preview and index
+        check "$code $width: crop" "$CODER $dec -p -crop 37,123,301,222 $c $c.crop && cmp $img.crop $c.crop"
+        check "$code $width: crop from a pipe" "cat $c | $CODER $dec -p -crop 37,123,301,222 | cmp $img.crop -"
+        check "$code $width: preview" "$CODER $dec -preview4 $c $c.pgm && cmp $img.pgm $c.pgm"
+        check "$code $width: index while encoding" "$CODER -$code -mkindex64 $c.idx $img.p1 $c.ix && cmp $c $c.ix"
+        check "$code $width: crop with index" "$CODER $dec -p -crop 37,123,301,222 -index $c.idx $c $c.icrop && cmp $img.crop $c.icrop"
+        check "$code $width: index while decoding" "$CODER $dec -p -mkindex64 $c.didx $c $c.ix.p1 && samepbm $img.p1 $c.ix.p1 && cmp $c.idx $c.didx"
+    done
+
+    # recoding in the run domain gives the same stream as encoding directly
+    for from in g3 g32 g4
+    do
+        for to in g3 g32 g4
+        do
+            check "$from to $to $width: transcode" "$CODER -$from -transcode$width -$to $img.$from $img.$from.$to && cmp $img.$to $img.$from.$to"
+        done
+    done
+
+    # MMR header, plain and striped
+    c="$img.hdr"
+    check "g4 $width: header" "$CODER -g4 -hdr $img.p1 $c && $CODER -g4 -hdr -decode -p $c | cmp $img.p1 -"
+    check "g4 $width: strips" "$CODER -g4 -hdr -strips64 $img.p1 $c.s && $CODER -g4 -hdr -decode -p $c.s | cmp $img.p1 -"
+    check "g4 $width: strips on 1 thread" "$CODER -g4 -hdr -strips64 -threads1 $img.p1 $c.s1 && cmp $c.s $c.s1"
+    check "g4 $width: strips from a pipe" "cat $c.s | $CODER -g4 -hdr -decode -p | cmp $img.p1 -"
+    check "g4 $width: crop strips" "$CODER -g4 -hdr -decode -p -crop 37,123,301,222 $c.s | cmp $img.crop -"
+    check "g4 $width: crop strips from a pipe" "cat $c.s | $CODER -g4 -hdr -decode -p -crop 37,123,301,222 | cmp $img.crop -"
+    check "g4 $width: preview strips" "$CODER -g4 -hdr -decode -preview4 $c.s | cmp $img.pgm -"
+    check "g4 $width: transcode with header" "$CODER -g4 -hdr -transcode -g4 $c $c.tc && cmp $c $c.tc"
+done
+
+# streams of the original line by line encoder (d56731f) for gen W 120, in tests/golden:
+# every way of encoding has to give them byte for byte, and they decode to the image
+for width in 16 1728 1731
+do
+    img="$TMP/gold$width"
+    gen $width 120 >"$img.p1"
+    for code in g3 g32 g33 g34 g4
+    do
+        g="$GOLDEN/img$width.$code"
+        check "$code $width: golden stream" "$CODER -$code $img.p1 $img.$code && cmp $g $img.$code"
+        for threads in 2 3 7
+        do
+            check "$code $width: golden stream on $threads threads" "$CODER -$code -threads$threads $img.p1 | cmp $g -"
+        done
+        check "$code $width: decode golden stream" "$CODER -$code -decode$width -p $g | cmp $img.p1 -"
+        check "$code $width: decode golden stream on 4 threads" "$CODER -$code -decode$width -p -threads4 $g $img.$code.p1 && samepbm $img.p1 $img.$code.p1"
+    done
+done
+check "g4 1731: golden stream with header" "$CODER -g4 -hdr $TMP/gold1731.p1 | cmp $GOLDEN/img1731.hdr -"
+
+# corrupt input: an error code, not a crash
+# width 16, line 1 white/black/white at 4 and 8; line 2: V0, then a pass code to the end of the line
+printf '\066\361\000\020\001' >"$TMP/pass.g4"
+check "g4: pass code to the end of a line" "corrupt -5 -g4 -decode16 -p $TMP/pass.g4"
+check "g4: pass code to the end of a line, preview" "corrupt -5 -g4 -decode16 -preview4 $TMP/pass.g4"
+printf '\002\000\000' >"$TMP/ext.g4"   # an extension code (0000001xxx) as the first code
+check "g4: extension code" "corrupt -4 -g4 -decode16 -p $TMP/ext.g4"
+
+# truncated streams: the parallel decoder stops with the same rows and error as the serial one
+for code in g3 g32
+do
+    dd if="$GOLDEN/img1731.$code" of="$TMP/cut.$code" bs=3000 count=1 2>/dev/null
+    check "$code: truncated stream" "corrupt -2 -$code -decode1731 -p -threads1 $TMP/cut.$code && mv $TMP/corrupt.pbm $TMP/serial.pbm && corrupt -2 -$code -decode1731 -p -threads4 $TMP/cut.$code && cmp $TMP/serial.pbm $TMP/corrupt.pbm"
+done
+
+# g32 CODE: G3 2d stream of width 16: 100 white 1d lines, each followed by a white 2d line
+# (V0), but 2d line 75 is CODE. Each line starts with fill bits, so it ends on a byte boundary
+g32()
+{
+    iA=0
+    while [ $iA -lt 100 ]
+    do
+        printf '\000\000\352'
+        if [ $iA -eq 75 ]
+        then
+            printf "$1"
+        else
+            printf '\000\005'
+        fi
+        iA=$((iA+1))
+    done
+}
+
+# the parallel decoder has to stop at the same row with the same error as the serial one
+g32 '\000\000\203' >"$TMP/vr2.g32"   # VR2 beyond the end of the line
+check "g32: V code beyond the end of a line" "corrupt -5 -g32 -decode16 -p -threads1 $TMP/vr2.g32 && mv $TMP/corrupt.pbm $TMP/serial.pbm && corrupt -5 -g32 -decode16 -p -threads4 $TMP/vr2.g32 && cmp $TMP/serial.pbm $TMP/corrupt.pbm"
+g32 '\000\000\023' >"$TMP/vr1.g32"   # VR1 beyond the end of the line, decoded by the V0/VR1/VL1 fast path
+check "g32: VR1 code beyond the end of a line" "corrupt -5 -g32 -decode16 -p -threads1 $TMP/vr1.g32 && mv $TMP/corrupt.pbm $TMP/serial.pbm && corrupt -5 -g32 -decode16 -p -threads4 $TMP/vr1.g32 && cmp $TMP/serial.pbm $TMP/corrupt.pbm"
+echo "$((count-fail)) of $count checks passed"
+[ $fail -eq 0 ]